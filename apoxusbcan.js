@@ -21,6 +21,9 @@
 
 var util = require('util');
 var events = require('events');
+var stream = require('stream');
+var net = require('net');
+var fs = require('fs');
 var apoxusbcan = require('bindings')('apoxusbcan.node');
 
 // Make sure the addon inherit from EventEmitter
@@ -28,6 +31,28 @@ apoxusbcan.ApoxUsbCan.prototype.__proto__ = events.EventEmitter.prototype
 
 var MESSAGE_CALLBACK_TIMEOUT = 1000;
 
+var DEFAULT_HIGH_WATER_MARK = 1024;
+
+// Bytes a client may have pending on its socket before CAN Bus messages are dropped for it
+var MAX_CLIENT_BACKLOG = 1024 * 1024;
+
+// Anyone who can connect to the socket can transmit on the CAN bus
+var DEFAULT_SOCKET_MODE = parseInt('600', 8);
+
+// Scheduling policies, see RealtimePolicy in node_apoxusbcan.h
+var REALTIME_POLICIES = {
+  'none': 0,
+  'fifo': 1,
+  'rr': 2
+};
+
+// Flow control policies, see FlowControlPolicy in node_apoxusbcan.h
+var FLOW_CONTROL_POLICIES = {
+  'block': 0,
+  'drop-oldest': 1,
+  'drop-newest': 2
+};
+
 // These are the board commands. Not all of them are used, but are listed here for
 // future reference.
 
@@ -166,6 +191,158 @@ ApoxUsbCan.prototype.isMainCodeRunning = function(callback) {
   }, 2); // notice here the retry!
 };
 
+// Reassemble J1939 transport protocol (BAM and RTS/CTS) and NMEA 2000 fast-packet
+// sessions natively. Complete messages are emitted as 'pgnmessage' events.
+// The options argument is optional.
+ApoxUsbCan.prototype.enableReassembly = function(options) {
+  options = options || {};
+  this.setReassembly(true, options.timeout, options.fastPacketPgns, options.emitFragments);
+};
+
+ApoxUsbCan.prototype.disableReassembly = function() {
+  this.setReassembly(false);
+};
+
+// Maintain bus load and per-ID traffic statistics natively, see getTrafficStats().
+// The options argument is optional.
+ApoxUsbCan.prototype.enableTrafficStats = function(options) {
+  options = options || {};
+  this.setTrafficStats(true, options.baudRate, options.window, options.timestampTick);
+};
+
+ApoxUsbCan.prototype.disableTrafficStats = function() {
+  this.setTrafficStats(false);
+};
+
+// Polls the error counters and status of the CAN controller natively, and emits
+// 'busstate' when it goes error-active, error-passive or bus-off. The replies
+// to the polling commands are not emitted as 'boardmessage'.
+// The options argument is optional.
+ApoxUsbCan.prototype.enableBusMonitor = function(options) {
+  options = options || {};
+  this.setBusMonitor(true, options.interval, !!options.autoRecover);
+};
+
+ApoxUsbCan.prototype.disableBusMonitor = function() {
+  this.setBusMonitor(false);
+};
+
+// Configures the USB read thread for real-time operation. Must be called before
+// open(). The options argument is optional, omitting it restores the defaults.
+ApoxUsbCan.prototype.setRealtime = function(options) {
+  options = options || {};
+  var policy = options.policy || 'none';
+
+  if (!(policy in REALTIME_POLICIES)) {
+    throw new Error("Unknown scheduling policy: " + policy);
+  }
+
+  this.setRealtimeConfig(options.cpu !== undefined ? options.cpu : -1, REALTIME_POLICIES[policy],
+                         options.priority, !!options.lockMemory, !!options.busyPoll);
+};
+
+// Installs a frame sent by the read thread, without going through JS, whenever a
+// frame matching the trigger is received. Returns the rule number.
+//
+// trigger: { id, [mask], [extended], [rtr] } (rtr: true or false, any if omitted)
+// response: { id, [extended], [rtr], [data] }
+ApoxUsbCan.prototype.addAutoResponse = function(trigger, response) {
+  var triggerExtended = trigger.extended !== undefined ? trigger.extended : (trigger.id >>> 11) > 0;
+  var triggerMask = trigger.mask !== undefined ? trigger.mask : (triggerExtended ? 0x1fffffff : 0x7ff);
+  var responseExtended = response.extended !== undefined ? response.extended : (response.id >>> 11) > 0;
+
+  return this.addAutoResponseRule(trigger.id, triggerMask, triggerExtended, trigger.rtr,
+                                  !!response.rtr, response.id, responseExtended, response.data);
+};
+
+// Ends the read stream, if any, e.g. when the device is closed
+var endReadStream = function(self) {
+  if (self._readStream) {
+    var readable = self._readStream;
+    cleanUpReadStream(self);
+    readable.push(null);
+  }
+};
+
+var cleanUpReadStream = function(self) {
+  self.removeListener('canbusmessage', self._readStreamCallback);
+  self.setFlowControl(0);
+  self.resumeCanBusMessages();
+  self._readStream = null;
+  self._readStreamCallback = null;
+};
+
+ApoxUsbCan.prototype.close = function() {
+  apoxusbcan.ApoxUsbCan.prototype.close.apply(this, arguments);
+  endReadStream(this);
+};
+
+// Returns an object mode Readable stream of CAN Bus messages. When the stream
+// buffer is full, the native delivery is paused and the read thread applies
+// the flow control policy once highWaterMark messages are queued natively.
+// The flow control and the pause are device-wide, so only one stream can be
+// open at a time; it ends when the device is closed.
+// The options argument is optional.
+ApoxUsbCan.prototype.createReadStream = function(options) {
+  var self = this;
+
+  if (self._readStream) {
+    throw new Error("A read stream is already open");
+  }
+
+  options = options || {};
+  var highWaterMark = options.highWaterMark || DEFAULT_HIGH_WATER_MARK;
+  var policy = options.policy || 'block';
+
+  if (!(policy in FLOW_CONTROL_POLICIES)) {
+    throw new Error("Unknown flow control policy: " + policy);
+  }
+
+  var readable = new stream.Readable({
+    objectMode: true,
+    highWaterMark: highWaterMark,
+    read: function() {
+      self.resumeCanBusMessages();
+    },
+    destroy: function(err, callback) {
+      if (self._readStream === readable) {
+        cleanUpReadStream(self);
+      }
+      callback(err);
+    }
+  });
+
+  var dropCount = self.getDroppedCanBusMessageCount();
+
+  // Number of messages dropped by the read thread since the stream was created
+  Object.defineProperty(readable, 'droppedCount', {
+    get: function() {
+      return self.getDroppedCanBusMessageCount() - dropCount;
+    }
+  });
+
+  var messageCallback = function(timestamp, rtr, id, extended, flags, data) {
+    var frame = { timestamp: timestamp, rtr: rtr, id: id, extended: extended, flags: flags, data: data };
+    if (!readable.push(frame)) {
+      self.pauseCanBusMessages();
+    }
+  };
+
+  self.setFlowControl(highWaterMark, FLOW_CONTROL_POLICIES[policy]);
+  self.addListener('canbusmessage', messageCallback);
+
+  self._readStream = readable;
+  self._readStreamCallback = messageCallback;
+
+  return readable;
+};
+
+// Async iterator over CAN Bus messages, e.g. for await (const frame of usbcan.frames()).
+// Accepts the same options as createReadStream().
+ApoxUsbCan.prototype.frames = function(options) {
+  return this.createReadStream(options)[Symbol.asyncIterator]();
+};
+
 ApoxUsbCan.prototype.reset = function(callback) {
   this.sendBoardMessage(RESET_MICRO);
 
@@ -175,3 +352,471 @@ ApoxUsbCan.prototype.reset = function(callback) {
 };
 
 
+
+// ------ Sharing the device between processes ------
+//
+// The process owning the device can publish what it receives on a Unix domain
+// socket (a named pipe on Windows) with usbcan.listen(path). Other processes
+// connect with an ApoxUsbCanClient, which has the same API as ApoxUsbCan.
+//
+// Every record on the socket is: [0..1] LENGTH (LE, excluding these two bytes),
+// [2] TYPE, [3..n] payload as described below.
+
+// From the clients
+var RECORD_SET_FILTERS = 0x01;          // [COUNT (LE16)] then COUNT x [ID (LE32)][MASK (LE32)]
+var RECORD_SEND_CANBUS_MESSAGE = 0x02;  // [0x01 RTR | 0x02 EXT][ID (LE32)][DATA (0-8)]
+var RECORD_SEND_BOARD_MESSAGE = 0x03;   // [COMMAND]
+
+// From the server
+var RECORD_CANBUS_MESSAGE = 0x81;       // [TIMESTAMP (LE32)][ID (LE32)][0x01 RTR | 0x02 EXT][FLAGS][DATA LEN][DATA]
+var RECORD_BOARD_MESSAGE = 0x82;        // [ID][COMMAND][DATA]
+var RECORD_ERROR = 0x83;                // [MESSAGE (UTF-8)]
+var RECORD_DROPPED = 0x84;              // [COUNT (LE32)] CAN Bus messages dropped for this client
+var RECORD_PGN_MESSAGE = 0x85;          // [TIMESTAMP (LE32)][PRIORITY][PGN (LE32)][SOURCE][DESTINATION][DATA]
+var RECORD_PGN_DROPPED = 0x86;          // [COUNT (LE32)] PGN messages dropped for this client
+var RECORD_BUS_STATE = 0x87;            // [TX ERR CNT (LE16)][RX ERR CNT (LE16)][STATE (UTF-8)]
+
+function createRecord(type, payloadLength) {
+  var record = Buffer.allocUnsafe(3 + payloadLength);
+  record.writeUInt16LE(1 + payloadLength, 0);
+  record[2] = type;
+  return record;
+}
+
+// Returns a 'data' listener calling onRecord(type, payload) for every complete record
+function createRecordParser(onRecord) {
+  var pending = null;
+
+  return function(chunk) {
+    var buffer = pending ? Buffer.concat([pending, chunk]) : chunk;
+    var offset = 0;
+
+    while (buffer.length - offset >= 2) {
+      var length = buffer.readUInt16LE(offset);
+      if (buffer.length - offset - 2 < length) {
+        break;
+      }
+      if (length > 0) {
+        onRecord(buffer[offset + 2], buffer.slice(offset + 3, offset + 2 + length));
+      }
+      offset += 2 + length;
+    }
+
+    pending = offset < buffer.length ? Buffer.from(buffer.slice(offset)) : null;
+  };
+}
+
+// filters is a list of { id: ..., mask: ... }, an empty list matches everything
+function matchFilters(filters, id) {
+  if (filters.length == 0) {
+    return true;
+  }
+
+  for (var i = 0; i < filters.length; i++) {
+    if (((id ^ filters[i].id) & filters[i].mask) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+function publishDropCount(client, type, key) {
+  if (client[key] > 0) {
+    var dropped = createRecord(type, 4);
+    dropped.writeUInt32LE(client[key], 3);
+    client.socket.write(dropped);
+    client[key] = 0;
+  }
+}
+
+// dropCountKey names the client counter of the messages dropped when the client
+// doesn't keep up, the record is never dropped without it
+function publish(client, record, dropCountKey) {
+  var socket = client.socket;
+
+  // A slow client only loses its own messages
+  if (dropCountKey && socket.writableLength > MAX_CLIENT_BACKLOG) {
+    client[dropCountKey]++;
+    return;
+  }
+
+  // All the records written during a loop iteration go out in a single write
+  if (!client.corked) {
+    client.corked = true;
+    socket.cork();
+    setImmediate(function() {
+      client.corked = false;
+      socket.uncork();
+    });
+  }
+
+  publishDropCount(client, RECORD_DROPPED, 'dropCount');
+  publishDropCount(client, RECORD_PGN_DROPPED, 'pgnDropCount');
+
+  socket.write(record);
+}
+
+// Publishes the messages received from the device on a Unix domain socket. Returns
+// the net.Server: closing it disconnects every client. The options argument
+// ({ mode }) and the callback are optional.
+ApoxUsbCan.prototype.listen = function(path, options, callback) {
+  var self = this;
+  var clients = [];
+
+  if (typeof options == 'function') {
+    callback = options;
+    options = undefined;
+  }
+  options = options || {};
+  var mode = options.mode !== undefined ? options.mode : DEFAULT_SOCKET_MODE;
+
+  var server = net.createServer(function(socket) {
+    var client = { socket: socket, filters: [], dropCount: 0, pgnDropCount: 0, corked: false };
+    clients.push(client);
+
+    socket.on('data', createRecordParser(function(type, payload) {
+      try {
+        if (type == RECORD_SET_FILTERS) {
+          var filters = [];
+          var count = payload.readUInt16LE(0);
+          for (var i = 0; i < count; i++) {
+            filters.push({ id: payload.readUInt32LE(2 + i * 8), mask: payload.readUInt32LE(6 + i * 8) });
+          }
+          client.filters = filters;
+        } else if (type == RECORD_SEND_CANBUS_MESSAGE) {
+          self.sendCanBusMessage((payload[0] & 0x01) != 0, payload.readUInt32LE(1), (payload[0] & 0x02) != 0,
+                                 payload.slice(5));
+        } else if (type == RECORD_SEND_BOARD_MESSAGE) {
+          self.sendBoardMessage(payload[0]);
+        }
+      } catch (err) {
+        var message = Buffer.from(String(err.message || err));
+        var record = createRecord(RECORD_ERROR, message.length);
+        message.copy(record, 3);
+        publish(client, record, null);
+      }
+    }));
+
+    socket.on('error', function() {
+      // The client went away, 'close' follows
+    });
+
+    socket.on('close', function() {
+      clients.splice(clients.indexOf(client), 1);
+    });
+  });
+
+  var canBusMessageCallback = function(timestamp, rtr, id, extended, flags, data) {
+    var record = null; // encoded once, only if someone wants it
+
+    for (var i = 0; i < clients.length; i++) {
+      if (!matchFilters(clients[i].filters, id)) {
+        continue;
+      }
+
+      if (!record) {
+        var dataLength = data ? data.length : 0;
+        record = createRecord(RECORD_CANBUS_MESSAGE, 11 + dataLength);
+        record.writeUInt32LE(timestamp, 3);
+        record.writeUInt32LE(id, 7);
+        record[11] = (rtr ? 0x01 : 0x00) | (extended ? 0x02 : 0x00);
+        record[12] = flags;
+        record[13] = dataLength;
+        if (data) data.copy(record, 14);
+      }
+
+      publish(clients[i], record, 'dropCount');
+    }
+  };
+
+  var boardMessageCallback = function(id, command, data) {
+    var dataLength = data ? data.length : 0;
+    var record = createRecord(RECORD_BOARD_MESSAGE, 2 + dataLength);
+    record[3] = id;
+    record[4] = command;
+    if (data) data.copy(record, 5);
+
+    for (var i = 0; i < clients.length; i++) {
+      publish(clients[i], record, null);
+    }
+  };
+
+  var pgnMessageCallback = function(timestamp, priority, pgn, source, destination, data) {
+    var dataLength = data ? data.length : 0;
+    var record = createRecord(RECORD_PGN_MESSAGE, 11 + dataLength);
+    record.writeUInt32LE(timestamp, 3);
+    record[7] = priority;
+    record.writeUInt32LE(pgn, 8);
+    record[12] = source;
+    record[13] = destination;
+    if (data) data.copy(record, 14);
+
+    for (var i = 0; i < clients.length; i++) {
+      publish(clients[i], record, 'pgnDropCount');
+    }
+  };
+
+  var busStateCallback = function(state, txErrorCount, rxErrorCount) {
+    var text = Buffer.from(state);
+    var record = createRecord(RECORD_BUS_STATE, 4 + text.length);
+    record.writeUInt16LE(txErrorCount, 3);
+    record.writeUInt16LE(rxErrorCount, 5);
+    text.copy(record, 7);
+
+    for (var i = 0; i < clients.length; i++) {
+      publish(clients[i], record, null);
+    }
+  };
+
+  var errorCallback = function(message) {
+    var text = Buffer.from(String(message));
+    var record = createRecord(RECORD_ERROR, text.length);
+    text.copy(record, 3);
+
+    for (var i = 0; i < clients.length; i++) {
+      publish(clients[i], record, null);
+    }
+
+    // Listening must not swallow the error when the owner doesn't handle it
+    if (self.listenerCount('error') == 1) {
+      throw message instanceof Error ? message : new Error("Unhandled error. (" + message + ")");
+    }
+  };
+
+  self.addListener('canbusmessage', canBusMessageCallback);
+  self.addListener('boardmessage', boardMessageCallback);
+  self.addListener('pgnmessage', pgnMessageCallback);
+  self.addListener('busstate', busStateCallback);
+  self.addListener('error', errorCallback);
+
+  server.on('close', function() {
+    self.removeListener('canbusmessage', canBusMessageCallback);
+    self.removeListener('boardmessage', boardMessageCallback);
+    self.removeListener('pgnmessage', pgnMessageCallback);
+    self.removeListener('busstate', busStateCallback);
+    self.removeListener('error', errorCallback);
+  });
+
+  var serverClose = server.close;
+  server.close = function(callback) {
+    for (var i = 0; i < clients.length; i++) {
+      clients[i].socket.destroy();
+    }
+    return serverClose.call(server, callback);
+  };
+
+  // Named pipes have no file permissions nor stale files
+  var pipe = process.platform == 'win32';
+
+  var bind = function() {
+    if (pipe) {
+      server.listen(path);
+      return;
+    }
+
+    // The socket is created with the permissions of the umask, narrow them before it exists
+    var umask = process.umask(~mode & parseInt('777', 8));
+    try {
+      server.listen(path);
+    } finally {
+      process.umask(umask);
+    }
+  };
+
+  server.once('listening', function() {
+    try {
+      if (!pipe) fs.chmodSync(path, mode);
+    } catch (err) {
+      server.close();
+      server.emit('error', err);
+      return;
+    }
+    if (callback) callback();
+  });
+
+  // A socket left by a process that died would fail with EADDRINUSE: remove it,
+  // but never take over a live server (listen() then fails with EADDRINUSE)
+  var stat = null;
+  try {
+    if (!pipe) stat = fs.statSync(path);
+  } catch (err) {
+    // Nothing there
+  }
+
+  if (pipe || !stat || !stat.isSocket()) {
+    bind();
+    return server;
+  }
+
+  var probe = net.connect(path);
+  probe.on('connect', function() {
+    probe.destroy();
+    bind();
+  });
+  probe.on('error', function(err) {
+    if (err.code == 'ECONNREFUSED') {
+      try {
+        fs.unlinkSync(path);
+      } catch (unlinkErr) {
+        // bind() reports it
+      }
+    }
+    bind();
+  });
+
+  return server;
+};
+
+// A client of usbcan.listen(path), with the same API as ApoxUsbCan
+var ApoxUsbCanClient = exports.ApoxUsbCanClient = function(path) {
+  events.EventEmitter.call(this);
+  this.setMaxListeners(0); // we know what we're doing
+
+  this._path = path;
+  this._socket = null;
+  this._filters = [];
+  this._dropCount = 0;
+  this._pgnDropCount = 0;
+};
+
+util.inherits(ApoxUsbCanClient, events.EventEmitter);
+
+ApoxUsbCanClient.prototype.open = function() {
+  var self = this;
+
+  if (self._socket) {
+    return;
+  }
+
+  self._socket = net.connect(self._path);
+
+  self._socket.on('data', createRecordParser(function(type, payload) {
+    if (type == RECORD_CANBUS_MESSAGE) {
+      var data = payload[10] > 0 ? Buffer.from(payload.slice(11, 11 + payload[10])) : undefined;
+      self.emit('canbusmessage', payload.readUInt32LE(0), (payload[8] & 0x01) != 0, payload.readUInt32LE(4),
+                (payload[8] & 0x02) != 0, payload[9], data);
+    } else if (type == RECORD_BOARD_MESSAGE) {
+      self.emit('boardmessage', payload[0], payload[1], payload.length > 2 ? Buffer.from(payload.slice(2)) : undefined);
+    } else if (type == RECORD_PGN_MESSAGE) {
+      self.emit('pgnmessage', payload.readUInt32LE(0), payload[4], payload.readUInt32LE(5), payload[9], payload[10],
+                payload.length > 11 ? Buffer.from(payload.slice(11)) : undefined);
+    } else if (type == RECORD_BUS_STATE) {
+      self.emit('busstate', payload.slice(4).toString(), payload.readUInt16LE(0), payload.readUInt16LE(2));
+    } else if (type == RECORD_DROPPED) {
+      self._dropCount += payload.readUInt32LE(0);
+    } else if (type == RECORD_PGN_DROPPED) {
+      self._pgnDropCount += payload.readUInt32LE(0);
+    } else if (type == RECORD_ERROR) {
+      self.emit('error', payload.toString());
+    }
+  }));
+
+  self._socket.on('error', function(err) {
+    self.emit('error', "Connection to " + self._path + " failed: " + err.message);
+  });
+
+  self._socket.on('close', function() {
+    self._socket = null;
+  });
+
+  self.setFilters(self._filters);
+};
+
+ApoxUsbCanClient.prototype.close = function() {
+  if (this._socket) {
+    this._socket.destroy();
+    this._socket = null;
+  }
+  endReadStream(this);
+};
+
+// Only the CAN Bus messages matching one of the filters are sent to this client.
+// filters is a list of { id: ..., mask: ... }, an empty list receives everything.
+ApoxUsbCanClient.prototype.setFilters = function(filters) {
+  this._filters = filters || [];
+
+  if (this._socket) {
+    var record = createRecord(RECORD_SET_FILTERS, 2 + this._filters.length * 8);
+    record.writeUInt16LE(this._filters.length, 3);
+    for (var i = 0; i < this._filters.length; i++) {
+      var mask = this._filters[i].mask === undefined ? 0x1fffffff : this._filters[i].mask;
+      record.writeUInt32LE(this._filters[i].id >>> 0, 5 + i * 8);
+      record.writeUInt32LE(mask >>> 0, 9 + i * 8);
+    }
+    this._socket.write(record);
+  }
+};
+
+ApoxUsbCanClient.prototype.sendBoardMessage = function(command) {
+  if (!this._socket) {
+    throw new Error("Device not opened");
+  }
+
+  if (typeof command != 'number') {
+    throw new Error("Wrong argument type");
+  }
+
+  var record = createRecord(RECORD_SEND_BOARD_MESSAGE, 1);
+  record[3] = command;
+  this._socket.write(record);
+};
+
+// Same arguments as ApoxUsbCan.sendCanBusMessage: [rtr], canId, [extendedCanId], [canData]
+ApoxUsbCanClient.prototype.sendCanBusMessage = function() {
+  if (!this._socket) {
+    throw new Error("Device not opened");
+  }
+
+  var args = Array.prototype.slice.call(arguments);
+  var rtr = typeof args[0] == 'boolean' ? args.shift() : false;
+  var id = args.shift();
+
+  if (typeof id != 'number') {
+    throw new Error("Wrong argument type");
+  }
+
+  var extended = typeof args[0] == 'boolean' ? args.shift() : (id >>> 11) > 0;
+  var data = args.shift();
+
+  if (data !== undefined && !Buffer.isBuffer(data)) {
+    throw new Error("Wrong argument type");
+  }
+
+  var dataLength = data ? data.length : 0;
+  if (dataLength > 8) {
+    throw new Error("Too much data, maximum 8 bytes");
+  }
+
+  var record = createRecord(RECORD_SEND_CANBUS_MESSAGE, 5 + dataLength);
+  record[3] = (rtr ? 0x01 : 0x00) | (extended ? 0x02 : 0x00);
+  record.writeUInt32LE(id >>> 0, 4);
+  if (data) data.copy(record, 8);
+  this._socket.write(record);
+};
+
+// The socket applies the backpressure, the server drops for this client once its backlog is full
+ApoxUsbCanClient.prototype.setFlowControl = function() {
+};
+
+ApoxUsbCanClient.prototype.pauseCanBusMessages = function() {
+  if (this._socket) this._socket.pause();
+};
+
+ApoxUsbCanClient.prototype.resumeCanBusMessages = function() {
+  if (this._socket) this._socket.resume();
+};
+
+ApoxUsbCanClient.prototype.getDroppedCanBusMessageCount = function() {
+  return this._dropCount;
+};
+
+// PGN messages dropped by the server for this client, they are never dropped in the owning process
+ApoxUsbCanClient.prototype.getDroppedPgnMessageCount = function() {
+  return this._pgnDropCount;
+};
+
+['sendBoardMessageAndReceive', 'getHardwareVersion', 'getFirmwareVersion', 'switchToMainCode',
+ 'isMainCodeRunning', 'createReadStream', 'frames', 'reset'].forEach(function(name) {
+  ApoxUsbCanClient.prototype[name] = ApoxUsbCan.prototype[name];
+});
@@ -0,0 +1,299 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+// Microbenchmarks of the encode/decode hot paths. They run on synthetic
+// streams, so no USB-CAN adapter is needed:
+//
+//   $ ./build/Release/apoxusbcan_bench [frames]
+
+#include "canbus_message_queue.h"
+#include "traffic_stats.h"
+#include "usbcan_frame.h"
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define DEFAULT_FRAME_COUNT 1000000
+#define RUN_COUNT 5
+
+// Keeps the compiler from optimizing the measured work away
+static volatile unsigned int sink;
+
+typedef struct {
+  std::vector<unsigned char> bytes; // raw frames, back to back
+  std::vector<int> offsets;
+  std::vector<int> lengths;
+} FrameSet;
+
+// A random byte up to max, never a DLE
+static int NonDleByte(std::mt19937& random, int max)
+{
+  int value = std::uniform_int_distribution<int>(0, max - 1)(random);
+  return value >= USB_DLE ? value + 1 : value;
+}
+
+// A CAN bus frame as received from the board, with each ID, timestamp and data byte
+// being a DLE with exactly the given probability.
+static void AppendCanBusFrame(std::vector<unsigned char>& bytes, std::mt19937& random, double dleRatio)
+{
+  std::bernoulli_distribution dle(dleRatio);
+  std::uniform_int_distribution<int> dataLength(0, 8);
+
+  int length = dataLength(random);
+
+  bytes.push_back(0x80 | 0x20); // extended
+  for (int i = 0; i < 8; i++) { // ID and TIMESTAMP
+    bytes.push_back(dle(random) ? USB_DLE : NonDleByte(random, i == 3 ? 0x1f : 0xff));
+  }
+  bytes.push_back(0x00); // flags
+  bytes.push_back(length);
+  for (int i = 0; i < length; i++) {
+    bytes.push_back(dle(random) ? USB_DLE : NonDleByte(random, 0xff));
+  }
+}
+
+static FrameSet CreateFrameSet(int frameCount, double dleRatio)
+{
+  FrameSet frames;
+  std::mt19937 random(1939);
+
+  for (int i = 0; i < frameCount; i++) {
+    int offset = (int) frames.bytes.size();
+    AppendCanBusFrame(frames.bytes, random, dleRatio);
+    frames.offsets.push_back(offset);
+    frames.lengths.push_back((int) frames.bytes.size() - offset);
+  }
+
+  return frames;
+}
+
+// Encodes every frame as the board would send them over USB
+static std::vector<unsigned char> CreateUsbStream(FrameSet& frames)
+{
+  std::vector<unsigned char> stream;
+  unsigned char txBuffer[TX_BUFFER_LENGTH(19)];
+
+  for (size_t i = 0; i < frames.offsets.size(); i++) {
+    int txLength = EncodeUsbFrame(&frames.bytes[frames.offsets[i]], frames.lengths[i], txBuffer);
+    stream.insert(stream.end(), txBuffer, txBuffer + txLength);
+  }
+
+  return stream;
+}
+
+// Runs fn RUN_COUNT times and reports the best run
+template <typename Fn>
+static void Run(const char* name, int frameCount, Fn fn)
+{
+  double best = 0;
+
+  for (int run = 0; run < RUN_COUNT; run++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (run == 0 || elapsed.count() < best) {
+      best = elapsed.count();
+    }
+  }
+
+  printf("%-40s %10.1f ns/frame %14.0f frames/sec\n", name, best * 1e9 / frameCount, frameCount / best);
+}
+
+static void BenchUsbWrite(const char* name, FrameSet& frames)
+{
+  int frameCount = (int) frames.offsets.size();
+
+  Run(name, frameCount, [&]() {
+    unsigned char txBuffer[TX_BUFFER_LENGTH(19)];
+    unsigned int total = 0;
+
+    for (int i = 0; i < frameCount; i++) {
+      total += EncodeUsbFrame(&frames.bytes[frames.offsets[i]], frames.lengths[i], txBuffer);
+      total += txBuffer[total % 8];
+    }
+
+    sink = total;
+  });
+}
+
+static void BenchReadFrameState(const char* name, FrameSet& frames)
+{
+  int frameCount = (int) frames.offsets.size();
+  std::vector<unsigned char> stream = CreateUsbStream(frames);
+  UsbFrameDecoder* decoder = new UsbFrameDecoder;
+
+  Run(name, frameCount, [&]() {
+    unsigned int complete = 0;
+
+    InitUsbFrameDecoder(decoder);
+    for (size_t i = 0; i < stream.size(); i++) {
+      if (DecodeUsbByte(decoder, stream[i]) == RX_FRAME_COMPLETE) {
+        complete += decoder->length;
+      }
+    }
+
+    sink = complete;
+  });
+
+  delete decoder;
+}
+
+static void BenchCreateCanBusMessage(FrameSet& frames)
+{
+  int frameCount = (int) frames.offsets.size();
+
+  Run("CreateCanBusMessage", frameCount, [&]() {
+    unsigned int total = 0;
+
+    for (int i = 0; i < frameCount; i++) {
+      CanBusMessage* message = CreateCanBusMessage(&frames.bytes[frames.offsets[i]], frames.lengths[i]);
+      total += message->id ^ message->dataLength;
+      delete message;
+    }
+
+    sink = total;
+  });
+}
+
+static void BenchCreateBoardMessage(int frameCount)
+{
+  // Response to GET_FIRMWARE_VERSION
+  unsigned char rxFrameData[] = { 0x00, 0x44 | 0x80, '4', '.', '3' };
+
+  Run("CreateBoardMessage", frameCount, [&]() {
+    unsigned int total = 0;
+
+    for (int i = 0; i < frameCount; i++) {
+      BoardMessage* message = CreateBoardMessage(rxFrameData, sizeof rxFrameData);
+      total += message->command ^ message->dataLength;
+      delete message;
+    }
+
+    sink = total;
+  });
+}
+
+static void BenchTrafficStats(FrameSet& frames)
+{
+  int frameCount = (int) frames.offsets.size();
+  std::vector<CanBusMessage*> messages;
+
+  for (int i = 0; i < frameCount; i++) {
+    messages.push_back(CreateCanBusMessage(&frames.bytes[frames.offsets[i]], frames.lengths[i]));
+  }
+
+  // Real buses carry a few hundred IDs at most, the synthetic frames have random ones
+  for (int i = 0; i < frameCount; i++) {
+    messages[i]->id = 0x18fef000 | (messages[i]->id & 0xff);
+  }
+
+  TrafficStats* stats = new TrafficStats;
+
+  Run("TrafficStats::Record (256 IDs)", frameCount, [&]() {
+    uint64_t now = 1000000000;
+
+    stats->Reset();
+    for (int i = 0; i < frameCount; i++) {
+      CanBusMessage* message = messages[i];
+      now += 125000; // 8000 frames/sec
+      stats->Record(message->id, message->extended, message->rtr, message->data, message->dataLength,
+                    (unsigned int) (now / 1000000), now);
+    }
+  });
+
+  TrafficStatsSnapshot snapshot;
+  stats->Snapshot(0, &snapshot);
+  sink = (unsigned int) snapshot.ids.size();
+
+  delete stats;
+  for (int i = 0; i < frameCount; i++) {
+    delete messages[i];
+  }
+}
+
+static void BenchQueueAndEmit(FrameSet& frames)
+{
+  int frameCount = (int) frames.offsets.size();
+
+  // The queue of UsbReadThread and CanBusMessageEmitter, minus uv_async_send and V8:
+  // the emitter drains it in batches and copies the data like Nan::CopyBuffer.
+  CanBusMessageQueue* queue = new CanBusMessageQueue;
+  queue->SetFlowControl(1024, FLOW_CONTROL_BLOCK);
+  queue->Open();
+
+  Run("queue and emit (batches of 64)", frameCount, [&]() {
+    unsigned int total = 0;
+
+    for (int i = 0; i < frameCount; i++) {
+      queue->Push(CreateCanBusMessage(&frames.bytes[frames.offsets[i]], frames.lengths[i]));
+
+      if ((i + 1) % 64 == 0 || i == frameCount - 1) {
+        CanBusMessage* message;
+        while ((message = queue->Pop()) != NULL) {
+          char* buffer = (char*) malloc(message->dataLength > 0 ? message->dataLength : 1);
+          memcpy(buffer, message->data, message->dataLength);
+          total += buffer[0];
+          free(buffer);
+
+          delete message;
+        }
+      }
+    }
+
+    sink = total;
+  });
+
+  delete queue;
+}
+
+int main(int argc, char* argv[])
+{
+  int frameCount = argc > 1 ? atoi(argv[1]) : DEFAULT_FRAME_COUNT;
+
+  if (frameCount <= 0) {
+    fprintf(stderr, "usage: %s [frames]\n", argv[0]);
+    return 1;
+  }
+
+  // 1/256 is what uniform random bytes would give. Counters, J1939 addresses
+  // and NMEA 2000 payloads hit 0x10 a lot more often in practice.
+  FrameSet randomFrames = CreateFrameSet(frameCount, 1.0 / 256);
+  FrameSet dleFrames = CreateFrameSet(frameCount, 0.10);
+
+  printf("%d frames, best of %d runs\n\n", frameCount, RUN_COUNT);
+
+  BenchUsbWrite("UsbWrite stuffing (0.4% DLE)", randomFrames);
+  BenchUsbWrite("UsbWrite stuffing (10% DLE)", dleFrames);
+  BenchReadFrameState("ReadFrameState decoder (0.4% DLE)", randomFrames);
+  BenchReadFrameState("ReadFrameState decoder (10% DLE)", dleFrames);
+  BenchCreateCanBusMessage(randomFrames);
+  BenchCreateBoardMessage(frameCount);
+  BenchQueueAndEmit(randomFrames);
+  BenchTrafficStats(randomFrames);
+
+  return 0;
+}
@@ -9,7 +9,12 @@
       "include_dirs": ["<!(node -e \"require('nan')\")"],
       'sources': [
         'src/addon.cc',
-        'src/node_apoxusbcan.cc'
+        'src/bus_monitor.cc',
+        'src/canbus_message_queue.cc',
+        'src/j1939_reassembler.cc',
+        'src/node_apoxusbcan.cc',
+        'src/traffic_stats.cc',
+        'src/usbcan_frame.cc'
       ],
       'cflags_cc': [ '-std=c++17' ],
       "conditions": [
@@ -22,6 +27,27 @@
           },
         }],
       ]
+    },
+    {
+      'target_name': 'apoxusbcan_bench',
+      'type': 'executable',
+      'include_dirs': ['src'],
+      'sources': [
+        'bench/microbench.cc',
+        'src/canbus_message_queue.cc',
+        'src/traffic_stats.cc',
+        'src/usbcan_frame.cc'
+      ],
+      'cflags_cc': [ '-std=c++17' ],
+      "conditions": [
+        ['OS=="mac"', {
+          'xcode_settings': {
+            'OTHER_CFLAGS': [ '-std=c++17', '-stdlib=libc++' ],
+            'SDKROOT': 'macosx',
+            'MACOSX_DEPLOYMENT_TARGET': '10.7',
+          },
+        }],
+      ]
     }
   ]
 }
@@ -0,0 +1,164 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "bus_monitor.h"
+#include <string.h>
+
+// COMSTAT register of the PIC18 ECAN module
+#define COMSTAT_TXBO 0x20 // transmitter bus-off
+#define COMSTAT_TXBP 0x10 // transmitter error-passive
+#define COMSTAT_RXBP 0x08 // receiver error-passive
+
+// Error counters above this are error-passive (ISO 11898-1)
+#define ERROR_PASSIVE_LIMIT 128
+
+static const unsigned int BUS_MONITOR_POLL_COMMANDS[BUS_MONITOR_COMMANDS] = {
+  GET_TX_ERR_CNT,
+  GET_RX_ERR_CNT,
+  GET_CANSTAT,
+  GET_COMSTAT // last: the state is evaluated when its reply comes back
+};
+
+const char* BusStateName(BusState state)
+{
+  switch (state) {
+    case BUS_STATE_ERROR_ACTIVE:
+      return "error-active";
+    case BUS_STATE_ERROR_PASSIVE:
+      return "error-passive";
+    case BUS_STATE_BUS_OFF:
+      return "bus-off";
+    default:
+      return "unknown";
+  }
+}
+
+BusMonitor::BusMonitor()
+{
+  _enabled = false;
+  _interval = BUS_MONITOR_DEFAULT_INTERVAL;
+  _autoRecover = false;
+  Reset();
+}
+
+void BusMonitor::Configure(bool enabled, unsigned int interval, bool autoRecover)
+{
+  _enabled = enabled;
+  _interval = interval > 0 ? interval : BUS_MONITOR_DEFAULT_INTERVAL;
+  _autoRecover = autoRecover;
+  _lastPoll = 0;
+  memset(_pending, 0, sizeof _pending);
+
+  // The state is only known again after the next round
+  if (!enabled) {
+    _status.state = BUS_STATE_UNKNOWN;
+  }
+}
+
+bool BusMonitor::IsEnabled() const
+{
+  return _enabled;
+}
+
+void BusMonitor::Reset()
+{
+  _lastPoll = 0;
+  memset(_pending, 0, sizeof _pending);
+  memset(&_status, 0, sizeof _status);
+  _status.state = BUS_STATE_UNKNOWN;
+}
+
+int BusMonitor::Poll(uint64_t now, unsigned int* commands)
+{
+  if (!_enabled || (_lastPoll != 0 && now - _lastPoll < (uint64_t) _interval * 1000000)) {
+    return 0;
+  }
+
+  _lastPoll = now;
+
+  // Replies of a previous round still missing won't be waited for
+  for (int i = 0; i < BUS_MONITOR_COMMANDS; i++) {
+    _pending[i] = true;
+    commands[i] = BUS_MONITOR_POLL_COMMANDS[i];
+  }
+
+  return BUS_MONITOR_COMMANDS;
+}
+
+bool BusMonitor::ProcessReply(unsigned int command, const unsigned char* data, int dataLength, bool* changed, bool* recover)
+{
+  *changed = false;
+  *recover = false;
+
+  int index = -1;
+  for (int i = 0; i < BUS_MONITOR_COMMANDS; i++) {
+    if (BUS_MONITOR_POLL_COMMANDS[i] == command) {
+      index = i;
+      break;
+    }
+  }
+
+  // Anything not requested by the monitor goes to the listeners
+  if (index < 0 || !_pending[index] || dataLength < 1) {
+    return false;
+  }
+
+  _pending[index] = false;
+
+  switch (command) {
+    case GET_TX_ERR_CNT:
+      _status.txErrorCount = data[0];
+      return true;
+    case GET_RX_ERR_CNT:
+      _status.rxErrorCount = data[0];
+      return true;
+    case GET_CANSTAT:
+      _status.canstat = data[0];
+      return true;
+  }
+
+  _status.comstat = data[0];
+
+  BusState state = BUS_STATE_ERROR_ACTIVE;
+  if (_status.comstat & COMSTAT_TXBO) {
+    state = BUS_STATE_BUS_OFF;
+  } else if ((_status.comstat & (COMSTAT_TXBP | COMSTAT_RXBP)) ||
+             _status.txErrorCount >= ERROR_PASSIVE_LIMIT || _status.rxErrorCount >= ERROR_PASSIVE_LIMIT) {
+    state = BUS_STATE_ERROR_PASSIVE;
+  }
+
+  *changed = state != _status.state;
+  _status.state = state;
+
+  // Tried again every round until the controller is back on the bus
+  if (state == BUS_STATE_BUS_OFF && _autoRecover) {
+    *recover = true;
+    _status.recoveries++;
+  }
+
+  return true;
+}
+
+const BusStatus& BusMonitor::GetStatus() const
+{
+  return _status;
+}
@@ -0,0 +1,93 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#ifndef BUS_MONITOR_H
+#define BUS_MONITOR_H
+
+#include <stdint.h>
+
+// Board commands used by the monitor
+#define GET_TX_ERR_CNT 0x02
+#define GET_RX_ERR_CNT 0x03
+#define GET_CANSTAT 0x04
+#define GET_COMSTAT 0x05
+#define SET_CONFIG_MODE 0x20
+#define SET_NORMAL_MODE 0x22
+
+#define BUS_MONITOR_DEFAULT_INTERVAL 500 // milliseconds
+#define BUS_MONITOR_COMMANDS 4
+
+enum BusState {
+  BUS_STATE_UNKNOWN,
+  BUS_STATE_ERROR_ACTIVE,
+  BUS_STATE_ERROR_PASSIVE,
+  BUS_STATE_BUS_OFF
+};
+
+typedef struct {
+  BusState state;
+  unsigned int txErrorCount;
+  unsigned int rxErrorCount;
+  unsigned int canstat;
+  unsigned int comstat;
+  uint64_t recoveries;
+} BusStatus;
+
+const char* BusStateName(BusState state);
+
+// Polls the error counters and status registers of the CAN controller, and
+// tracks the fault confinement state from the replies. Not thread-safe:
+// callers serialize the access.
+class BusMonitor
+{
+public:
+  BusMonitor();
+
+  void Configure(bool enabled, unsigned int interval, bool autoRecover);
+  bool IsEnabled() const;
+
+  // Forgets the state, e.g. when the device is closed
+  void Reset();
+
+  // Fills commands with the board commands to send when a new round is due.
+  // Returns the number of commands.
+  int Poll(uint64_t now, unsigned int* commands);
+
+  // Returns true when the reply was requested by the monitor. *changed is set
+  // when the state changed, *recover when the recovery sequence must be sent.
+  bool ProcessReply(unsigned int command, const unsigned char* data, int dataLength, bool* changed, bool* recover);
+
+  const BusStatus& GetStatus() const;
+
+private:
+  bool _enabled;
+  unsigned int _interval;
+  bool _autoRecover;
+  uint64_t _lastPoll;
+
+  // Replies still expected for the current round, by command
+  bool _pending[BUS_MONITOR_COMMANDS];
+
+  BusStatus _status;
+};
+
+#endif
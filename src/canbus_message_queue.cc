@@ -0,0 +1,128 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "canbus_message_queue.h"
+
+CanBusMessageQueue::CanBusMessageQueue()
+{
+  _limit = 0;
+  _policy = FLOW_CONTROL_BLOCK;
+  _paused = false;
+  _closed = true;
+  _dropCount = 0;
+}
+
+CanBusMessageQueue::~CanBusMessageQueue()
+{
+  while (!_queue.empty()) {
+    delete _queue.front();
+    _queue.pop();
+  }
+}
+
+void CanBusMessageQueue::SetFlowControl(unsigned int limit, FlowControlPolicy policy)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _limit = limit;
+  _policy = policy;
+  _cond.notify_all();
+}
+
+bool CanBusMessageQueue::IsBlocking()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _limit > 0 && _policy == FLOW_CONTROL_BLOCK;
+}
+
+void CanBusMessageQueue::Pause()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _paused = true;
+}
+
+bool CanBusMessageQueue::Resume()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  bool paused = _paused;
+  _paused = false;
+  return paused;
+}
+
+uint64_t CanBusMessageQueue::GetDropCount()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _dropCount;
+}
+
+void CanBusMessageQueue::Open()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _closed = false;
+}
+
+void CanBusMessageQueue::Close()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _closed = true;
+  _cond.notify_all();
+}
+
+bool CanBusMessageQueue::Push(CanBusMessage* message)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while (!_closed && _limit > 0 && _queue.size() >= _limit) {
+    if (_policy == FLOW_CONTROL_BLOCK) {
+      // Stop reading: the frames are kept in the device buffers meanwhile
+      _cond.wait(lock);
+      continue;
+    }
+
+    _dropCount++;
+
+    if (_policy == FLOW_CONTROL_DROP_NEWEST) {
+      delete message;
+      return false;
+    }
+
+    delete _queue.front();
+    _queue.pop();
+  }
+
+  _queue.push(message);
+  return true;
+}
+
+CanBusMessage* CanBusMessageQueue::Pop()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // A listener may pause the delivery at any time, so it's checked before each message
+  if (_paused || _queue.empty()) {
+    return NULL;
+  }
+
+  CanBusMessage* message = _queue.front();
+  _queue.pop();
+  _cond.notify_one();
+  return message;
+}
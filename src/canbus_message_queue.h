@@ -0,0 +1,79 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#ifndef CANBUS_MESSAGE_QUEUE_H
+#define CANBUS_MESSAGE_QUEUE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <stdint.h>
+
+#include "usbcan_frame.h"
+
+// What the read thread does with a CAN Bus message once the queue is full
+enum FlowControlPolicy {
+  FLOW_CONTROL_BLOCK, // stop reading, the device buffers until the queue drains
+  FLOW_CONTROL_DROP_OLDEST,
+  FLOW_CONTROL_DROP_NEWEST
+};
+
+// CAN Bus messages on their way from the USB read thread to the emitter, with
+// the flow control policy applied once a limit is set. Thread-safe: the lock is
+// only held to push or pop a message, never while blocked on I/O, so it does
+// without the priority inheritance of the device mutexes.
+class CanBusMessageQueue
+{
+public:
+  CanBusMessageQueue();
+  ~CanBusMessageQueue();
+
+  // A limit of 0 leaves the queue unbounded
+  void SetFlowControl(unsigned int limit, FlowControlPolicy policy);
+  bool IsBlocking();
+
+  void Pause();
+  bool Resume(); // returns true when it was paused
+  uint64_t GetDropCount();
+
+  // Close() wakes up a Push() blocked on a full queue, and keeps it from blocking until Open()
+  void Open();
+  void Close();
+
+  // Called by the read thread. Returns false when the message was dropped (and deleted).
+  bool Push(CanBusMessage* message);
+
+  // Called by the emitter. Returns NULL when empty or paused.
+  CanBusMessage* Pop();
+
+private:
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::queue<CanBusMessage*> _queue;
+  unsigned int _limit;
+  FlowControlPolicy _policy;
+  bool _paused;
+  bool _closed;
+  uint64_t _dropCount;
+};
+
+#endif
@@ -0,0 +1,360 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "j1939_reassembler.h"
+#include <string.h>
+
+// Parameter groups of the SAE J1939-21 transport protocol
+#define J1939_PGN_TP_CM 0x00ec00
+#define J1939_PGN_TP_DT 0x00eb00
+
+// TP.CM control bytes
+#define J1939_TP_CM_RTS 0x10
+#define J1939_TP_CM_CTS 0x11
+#define J1939_TP_CM_EOM_ACK 0x13
+#define J1939_TP_CM_BAM 0x20
+#define J1939_TP_CM_ABORT 0xff
+
+J1939Reassembler::J1939Reassembler()
+{
+  _timeout = J1939_REASSEMBLY_DEFAULT_TIMEOUT;
+  _lastExpire = 0;
+  uv_mutex_init(&_poolMutex);
+}
+
+J1939Reassembler::~J1939Reassembler()
+{
+  Reset();
+
+  for (size_t i = 0; i < _pool.size(); i++) {
+    delete _pool[i];
+  }
+
+  uv_mutex_destroy(&_poolMutex);
+}
+
+void J1939Reassembler::SetTimeout(unsigned int timeout)
+{
+  _timeout = timeout;
+}
+
+void J1939Reassembler::SetFastPacketPgns(const std::vector<unsigned int>& pgns)
+{
+  _fastPacketPgns.clear();
+  _fastPacketPgns.insert(pgns.begin(), pgns.end());
+
+  // Sessions of PGNs that are no longer fast-packets would never complete
+  for (SessionTable::iterator it = _fpSessions.begin(); it != _fpSessions.end(); ) {
+    if (_fastPacketPgns.count(it->first >> 8) == 0) {
+      Release(it->second.message);
+      it = _fpSessions.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void J1939Reassembler::Reset()
+{
+  for (SessionTable::iterator it = _tpSessions.begin(); it != _tpSessions.end(); ++it) {
+    Release(it->second.message);
+  }
+  _tpSessions.clear();
+
+  for (SessionTable::iterator it = _fpSessions.begin(); it != _fpSessions.end(); ++it) {
+    Release(it->second.message);
+  }
+  _fpSessions.clear();
+}
+
+bool J1939Reassembler::Process(unsigned int id, unsigned int timestamp, const unsigned char* data, int dataLength,
+                               uint64_t now, PgnMessage** complete)
+{
+  // 29 bit identifier
+  // -----------------
+  // [28..26] PRIORITY
+  // [25..24] EDP, DP
+  // [23..16] PDU FORMAT (PF)
+  // [15..8]  PDU SPECIFIC (PS): destination address if PF < 240, group extension otherwise
+  // [7..0]   SOURCE ADDRESS
+  unsigned int priority = (id >> 26) & 0x07;
+  unsigned int pgn = (id >> 8) & 0x3ffff;
+  unsigned int source = id & 0xff;
+  unsigned int destination = 0xff;
+
+  if (((pgn >> 8) & 0xff) < 240) {
+    destination = pgn & 0xff;
+    pgn &= 0x3ff00;
+  }
+
+  *complete = NULL;
+
+  if (now - _lastExpire >= _timeout) {
+    ExpireSessions(now);
+  }
+
+  if (pgn == J1939_PGN_TP_CM && dataLength == 8) {
+    return ProcessTransportConnection(priority, source, destination, data, now);
+  }
+
+  if (pgn == J1939_PGN_TP_DT && dataLength == 8) {
+    return ProcessTransportData(timestamp, source, destination, data, now, complete);
+  }
+
+  if (!_fastPacketPgns.empty() && _fastPacketPgns.count(pgn) > 0) {
+    return ProcessFastPacket(timestamp, priority, pgn, source, destination, data, dataLength, now, complete);
+  }
+
+  return false;
+}
+
+bool J1939Reassembler::ProcessTransportConnection(unsigned int priority, unsigned int source, unsigned int destination,
+                                                  const unsigned char* data, uint64_t now)
+{
+  // TP.CM (RTS or BAM)
+  // ------------------
+  // [0] CONTROL BYTE
+  // [1] TOTAL MESSAGE SIZE LSB
+  // [2] TOTAL MESSAGE SIZE MSB
+  // [3] TOTAL NUMBER OF PACKETS
+  // [4] MAXIMUM NUMBER OF PACKETS PER CTS (RTS) or 0xFF (BAM)
+  // [5] PGN LSB
+  // [6] PGN
+  // [7] PGN MSB
+  unsigned int key = (source << 8) | destination;
+
+  switch (data[0]) {
+    case J1939_TP_CM_RTS:
+    case J1939_TP_CM_BAM: {
+      // A new announce always replaces the previous session between both nodes
+      DropSession(_tpSessions, key);
+
+      int totalLength = data[1] | (data[2] << 8);
+      int totalPackets = data[3];
+
+      if (totalLength < 9 || totalLength > J1939_TP_MAX_LENGTH || totalPackets != (totalLength + 6) / 7) {
+        return false;
+      }
+
+      // The destination of an RTS has to answer it: it must still be emitted
+      bool broadcast = data[0] == J1939_TP_CM_BAM;
+
+      Session& session = _tpSessions[key];
+      session.message = Acquire();
+      session.broadcast = broadcast;
+      session.message->priority = priority;
+      session.message->pgn = data[5] | (data[6] << 8) | ((data[7] & 0x03) << 16);
+      session.message->source = source;
+      session.message->destination = destination;
+      session.totalLength = totalLength;
+      session.totalPackets = totalPackets;
+      session.receivedLength = 0;
+      session.nextSequence = 1;
+      session.sequenceId = 0;
+      session.lastFrameTime = now;
+      return broadcast;
+    }
+    case J1939_TP_CM_ABORT:
+      // The abort may be sent by either end of the connection
+      DropSession(_tpSessions, key);
+      DropSession(_tpSessions, (destination << 8) | source);
+      return false;
+    case J1939_TP_CM_CTS:
+    case J1939_TP_CM_EOM_ACK:
+    default:
+      // Flow control is left to the nodes involved
+      return false;
+  }
+}
+
+bool J1939Reassembler::ProcessTransportData(unsigned int timestamp, unsigned int source, unsigned int destination,
+                                            const unsigned char* data, uint64_t now, PgnMessage** complete)
+{
+  // TP.DT
+  // -----
+  // [0] SEQUENCE NUMBER (1..255)
+  // [1..7] DATA BYTES
+  unsigned int key = (source << 8) | destination;
+
+  SessionTable::iterator it = _tpSessions.find(key);
+  if (it == _tpSessions.end()) {
+    return false;
+  }
+
+  Session& session = it->second;
+  bool consumed = session.broadcast;
+
+  if (data[0] != session.nextSequence) {
+    DropSession(_tpSessions, key);
+    return consumed;
+  }
+
+  int length = session.totalLength - session.receivedLength;
+  if (length > 7) {
+    length = 7;
+  }
+
+  memcpy(session.message->data + session.receivedLength, data + 1, length);
+  session.receivedLength += length;
+  session.nextSequence++;
+  session.lastFrameTime = now;
+
+  if (session.nextSequence > session.totalPackets) {
+    session.message->timestamp = timestamp;
+    session.message->dataLength = session.totalLength;
+    *complete = session.message;
+    _tpSessions.erase(it);
+  }
+
+  return consumed;
+}
+
+bool J1939Reassembler::ProcessFastPacket(unsigned int timestamp, unsigned int priority, unsigned int pgn, unsigned int source,
+                                         unsigned int destination, const unsigned char* data, int dataLength,
+                                         uint64_t now, PgnMessage** complete)
+{
+  // NMEA 2000 fast-packet
+  // ---------------------
+  // [0] ([SEQUENCE ID 0..2][FRAME COUNTER 0..31])
+  // [1] TOTAL MESSAGE SIZE (first frame only)
+  // [2..7] DATA BYTES (first frame), [1..7] DATA BYTES (following frames)
+  if (dataLength < 1) {
+    return true;
+  }
+
+  unsigned int key = (pgn << 8) | source;
+  int sequenceId = data[0] >> 5;
+  int frame = data[0] & 0x1f;
+
+  SessionTable::iterator it;
+
+  if (frame == 0) {
+    DropSession(_fpSessions, key);
+
+    if (dataLength < 2 || data[1] > N2K_FAST_PACKET_MAX_LENGTH) {
+      return true;
+    }
+
+    it = _fpSessions.emplace(key, Session()).first;
+
+    Session& session = it->second;
+    session.message = Acquire();
+    session.message->priority = priority;
+    session.message->pgn = pgn;
+    session.message->source = source;
+    session.message->destination = destination;
+    session.totalLength = data[1];
+    session.totalPackets = 0;
+    session.receivedLength = 0;
+    session.nextSequence = 0;
+    session.sequenceId = sequenceId;
+
+    data += 2;
+    dataLength -= 2;
+  } else {
+    it = _fpSessions.find(key);
+    if (it == _fpSessions.end()) {
+      return true;
+    }
+
+    if (it->second.sequenceId != sequenceId || it->second.nextSequence != frame) {
+      DropSession(_fpSessions, key);
+      return true;
+    }
+
+    data += 1;
+    dataLength -= 1;
+  }
+
+  Session& session = it->second;
+
+  int length = session.totalLength - session.receivedLength;
+  if (length > dataLength) {
+    length = dataLength;
+  }
+
+  memcpy(session.message->data + session.receivedLength, data, length);
+  session.receivedLength += length;
+  session.nextSequence++;
+  session.lastFrameTime = now;
+
+  if (session.receivedLength >= session.totalLength) {
+    session.message->timestamp = timestamp;
+    session.message->dataLength = session.totalLength;
+    *complete = session.message;
+    _fpSessions.erase(it);
+  }
+
+  return true;
+}
+
+void J1939Reassembler::DropSession(SessionTable& table, unsigned int key)
+{
+  SessionTable::iterator it = table.find(key);
+  if (it != table.end()) {
+    Release(it->second.message);
+    table.erase(it);
+  }
+}
+
+void J1939Reassembler::ExpireSessions(uint64_t now)
+{
+  SessionTable* tables[] = { &_tpSessions, &_fpSessions };
+
+  for (int i = 0; i < 2; i++) {
+    for (SessionTable::iterator it = tables[i]->begin(); it != tables[i]->end(); ) {
+      if (now - it->second.lastFrameTime > _timeout) {
+        Release(it->second.message);
+        it = tables[i]->erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  _lastExpire = now;
+}
+
+PgnMessage* J1939Reassembler::Acquire()
+{
+  PgnMessage* message = NULL;
+
+  uv_mutex_lock(&_poolMutex);
+  if (!_pool.empty()) {
+    message = _pool.back();
+    _pool.pop_back();
+  }
+  uv_mutex_unlock(&_poolMutex);
+
+  if (message == NULL) {
+    message = new PgnMessage;
+  }
+
+  return message;
+}
+
+void J1939Reassembler::Release(PgnMessage* message)
+{
+  uv_mutex_lock(&_poolMutex);
+  _pool.push_back(message);
+  uv_mutex_unlock(&_poolMutex);
+}
@@ -0,0 +1,116 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#ifndef J1939_REASSEMBLER_H
+#define J1939_REASSEMBLER_H
+
+#include <uv.h>
+
+#include <stdint.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Largest payload of a J1939 transport protocol session (255 packets of 7 bytes).
+#define J1939_TP_MAX_LENGTH 1785
+
+// Largest payload of a NMEA 2000 fast-packet (6 bytes + 31 frames of 7 bytes).
+#define N2K_FAST_PACKET_MAX_LENGTH 223
+
+#define J1939_REASSEMBLY_DEFAULT_TIMEOUT 750 // T1 of SAE J1939-21, in milliseconds
+
+typedef struct {
+  unsigned int timestamp;
+  unsigned int priority;
+  unsigned int pgn;
+  unsigned int source;
+  unsigned int destination;
+  unsigned char data[J1939_TP_MAX_LENGTH];
+  int dataLength;
+} PgnMessage;
+
+// Reassembles SAE J1939 transport protocol (TP.CM/TP.DT, BAM and RTS/CTS) and
+// NMEA 2000 fast-packet sessions from 29-bit CAN frames. The reassembler only
+// listens: it never answers with CTS or abort frames. RTS/CTS sessions belong to
+// the nodes involved, so their frames are reassembled but never consumed.
+//
+// Process() is meant to be called from the USB read thread only. Completed
+// messages come from a pool and must be handed back with Release(), which is
+// safe to call from any thread.
+class J1939Reassembler
+{
+public:
+  J1939Reassembler();
+  ~J1939Reassembler();
+
+  void SetTimeout(unsigned int timeout);
+  void SetFastPacketPgns(const std::vector<unsigned int>& pgns);
+  void Reset();
+
+  // Returns true when the frame was consumed by the reassembler: a BAM announce, the
+  // TP.DT of a BAM session, or a fast-packet frame. When the frame completes a
+  // message, it is returned through *complete.
+  bool Process(unsigned int id, unsigned int timestamp, const unsigned char* data, int dataLength,
+               uint64_t now, PgnMessage** complete);
+
+  void Release(PgnMessage* message);
+
+private:
+  typedef struct {
+    PgnMessage* message;
+    bool broadcast; // BAM, as opposed to RTS/CTS
+    int totalLength;
+    int totalPackets;
+    int receivedLength;
+    int nextSequence;
+    int sequenceId;
+    uint64_t lastFrameTime;
+  } Session;
+
+  typedef std::unordered_map<unsigned int, Session> SessionTable;
+
+  bool ProcessTransportConnection(unsigned int priority, unsigned int source, unsigned int destination,
+                                  const unsigned char* data, uint64_t now);
+  bool ProcessTransportData(unsigned int timestamp, unsigned int source, unsigned int destination,
+                            const unsigned char* data, uint64_t now, PgnMessage** complete);
+  bool ProcessFastPacket(unsigned int timestamp, unsigned int priority, unsigned int pgn, unsigned int source,
+                         unsigned int destination, const unsigned char* data, int dataLength,
+                         uint64_t now, PgnMessage** complete);
+
+  void DropSession(SessionTable& table, unsigned int key);
+  void ExpireSessions(uint64_t now);
+
+  PgnMessage* Acquire();
+
+  unsigned int _timeout;
+  uint64_t _lastExpire;
+
+  std::unordered_set<unsigned int> _fastPacketPgns;
+
+  SessionTable _tpSessions; // keyed by source << 8 | destination
+  SessionTable _fpSessions; // keyed by pgn << 8 | source
+
+  uv_mutex_t _poolMutex;
+  std::vector<PgnMessage*> _pool;
+};
+
+#endif
@@ -20,7 +20,17 @@
 // USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "node_apoxusbcan.h"
+#include <errno.h>
+#include <math.h>
 #include <string.h>
+#include <libusb.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
 
 // Part of this work is based on examples provided on the Apox Controls
 // website (http://www.apoxcontrols.com/).
@@ -28,12 +38,14 @@
 #define FTDI_VID 0x0403
 #define FTDI_PID 0xf9b8
 
-// Definitions for USB message start and end char
-#define USB_DLE 0x10
-#define USB_STX 0x02
-#define USB_ETX 0x03
+#define RX_READ_BUFFER_LENGTH 2048 // same as the read data chunksize
+#define READ_ERROR_BACKOFF_MAX 100 // milliseconds between reads after repeated errors
 
-#define RX_FRAME_DATA_MAX_LENGTH 32768 // XXX Isn't it a bit too big? There is only one Board or CAN Bus message that's going to fit in here.
+// Board commands changing the CAN bus baud rate
+#define SET_BAUD_1MEG 0x30
+#define SET_BAUD_500K 0x31
+#define SET_BAUD_250K 0x32
+#define SET_BAUD_125K 0x33
 
 #define RAISE_USBCANERROR(input, format, args...) \
       UsbCanError* error = new UsbCanError; \
@@ -43,24 +55,8 @@
 
 using namespace node;
 
-BoardMessage* CreateBoardMessage(unsigned char* rxFrameData, int rxFrameLength);
-CanBusMessage* CreateCanBusMessage(unsigned char* rxFrameData, int rxFrameLength);
-
 Nan::Persistent<v8::Function> ApoxUsbCan::constructor;
 
-enum ReadFrameState {
-  RX_FRAME_IDLE,
-  RX_FRAME_START,
-  RX_FRAME_CONTENT,
-  RX_FRAME_CONTENT_NLE,
-  RX_FRAME_COMPLETE,
-  RX_FRAME_ERROR_EXPECTING_DLE,
-  RX_FRAME_ERROR_EXPECTING_STX,
-  RX_FRAME_ERROR_EXPECTING_ETX,
-  RX_FRAME_ERROR_BAD_CHECKSUM,
-  RX_FRAME_ERROR_BUFFER_OVERFLOW
-};
-
 NAN_MODULE_INIT(ApoxUsbCan::Init)
 {
   Nan::HandleScope scope;
@@ -76,6 +72,21 @@ NAN_MODULE_INIT(ApoxUsbCan::Init)
   Nan::SetPrototypeMethod(tpl, "sendBoardMessage", ApoxUsbCan::SendBoardMessage);
   Nan::SetPrototypeMethod(tpl, "sendCanBusMessage", ApoxUsbCan::SendCanBusMessage);
   Nan::SetPrototypeMethod(tpl, "usbWrite", ApoxUsbCan::UsbWrite);
+  Nan::SetPrototypeMethod(tpl, "setReassembly", ApoxUsbCan::SetReassembly);
+  Nan::SetPrototypeMethod(tpl, "setFlowControl", ApoxUsbCan::SetFlowControl);
+  Nan::SetPrototypeMethod(tpl, "pauseCanBusMessages", ApoxUsbCan::PauseCanBusMessages);
+  Nan::SetPrototypeMethod(tpl, "resumeCanBusMessages", ApoxUsbCan::ResumeCanBusMessages);
+  Nan::SetPrototypeMethod(tpl, "getDroppedCanBusMessageCount", ApoxUsbCan::GetDroppedCanBusMessageCount);
+  Nan::SetPrototypeMethod(tpl, "setTrafficStats", ApoxUsbCan::SetTrafficStats);
+  Nan::SetPrototypeMethod(tpl, "getTrafficStats", ApoxUsbCan::GetTrafficStats);
+  Nan::SetPrototypeMethod(tpl, "addAutoResponseRule", ApoxUsbCan::AddAutoResponseRule);
+  Nan::SetPrototypeMethod(tpl, "removeAutoResponse", ApoxUsbCan::RemoveAutoResponse);
+  Nan::SetPrototypeMethod(tpl, "clearAutoResponses", ApoxUsbCan::ClearAutoResponses);
+  Nan::SetPrototypeMethod(tpl, "getAutoResponseStats", ApoxUsbCan::GetAutoResponseStats);
+  Nan::SetPrototypeMethod(tpl, "setRealtimeConfig", ApoxUsbCan::SetRealtimeConfig);
+  Nan::SetPrototypeMethod(tpl, "getReadThreadStats", ApoxUsbCan::GetReadThreadStats);
+  Nan::SetPrototypeMethod(tpl, "setBusMonitor", ApoxUsbCan::SetBusMonitor);
+  Nan::SetPrototypeMethod(tpl, "getBusState", ApoxUsbCan::GetBusState);
 
   constructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
   Nan::Set(target, Nan::New("ApoxUsbCan").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
@@ -150,11 +161,11 @@ NAN_METHOD(ApoxUsbCan::Open)
     return;
   }
 
-  // Launch the USB read thread
-  input->_usbRead = true;
-  uv_thread_create(&input->_usbReadThread, UsbReadThread, input);
+  uv_mutex_lock(&input->_readThreadStatsMutex);
+  memset(&input->_readThreadStats, 0, sizeof input->_readThreadStats);
+  uv_mutex_unlock(&input->_readThreadStatsMutex);
 
-  // Prepare emit async tasks
+  // Prepare emit async tasks, before the read thread may use them
   input->_usbCanErrorEmitAsync.data = input;
   uv_async_init(uv_default_loop(), &input->_usbCanErrorEmitAsync, UsbCanErrorEmitter);
   uv_unref((uv_handle_t*)&input->_usbCanErrorEmitAsync); // allow the event loop to exit while this is running
@@ -167,10 +178,23 @@ NAN_METHOD(ApoxUsbCan::Open)
   uv_async_init(uv_default_loop(), &input->_canBusMessageEmitAsync, CanBusMessageEmitter);
   uv_unref((uv_handle_t*)&input->_canBusMessageEmitAsync); // allow the event loop to exit while this is running
 
+  input->_pgnMessageEmitAsync.data = input;
+  uv_async_init(uv_default_loop(), &input->_pgnMessageEmitAsync, PgnMessageEmitter);
+  uv_unref((uv_handle_t*)&input->_pgnMessageEmitAsync); // allow the event loop to exit while this is running
+
+  input->_busStateEmitAsync.data = input;
+  uv_async_init(uv_default_loop(), &input->_busStateEmitAsync, BusStateEmitter);
+  uv_unref((uv_handle_t*)&input->_busStateEmitAsync); // allow the event loop to exit while this is running
+
   // A hack to keep a reference on the default loop, to let the read thread running in background
   uv_prepare_init(uv_default_loop(), &input->_loopHolder);
   uv_prepare_start(&input->_loopHolder, NULL);
 
+  // Launch the USB read thread
+  input->_usbRead = true;
+  input->_canBusMessageQueue.Open();
+  uv_thread_create(&input->_usbReadThread, UsbReadThread, input);
+
   input->_opened = true;
 
   info.GetReturnValue().SetUndefined();
@@ -191,6 +215,10 @@ NAN_METHOD(ApoxUsbCan::Close)
   // Stop the USB read thread
   if (input->_usbRead) {
     input->_usbRead = false;
+
+    // Wake up the read thread if it's blocked on a full queue
+    input->_canBusMessageQueue.Close();
+
     uv_thread_join(&input->_usbReadThread);
   }
 
@@ -198,6 +226,16 @@ NAN_METHOD(ApoxUsbCan::Close)
 
   uv_mutex_lock(&input->_usbWriteMutex);
   uv_mutex_unlock(&input->_usbWriteMutex);
+
+  // Partial transport sessions won't survive the device being closed
+  uv_mutex_lock(&input->_reassemblyMutex);
+  input->_reassembler.Reset();
+  uv_mutex_unlock(&input->_reassemblyMutex);
+
+  // Nor does the bus state: it is reported again once reopened
+  uv_mutex_lock(&input->_busMonitorMutex);
+  input->_busMonitor.Reset();
+  uv_mutex_unlock(&input->_busMonitorMutex);
  
   // Close USB
   if (ftdi_usb_close(&input->_ftdic) < 0) {
@@ -360,372 +398,1311 @@ NAN_METHOD(ApoxUsbCan::UsbWrite)
   info.GetReturnValue().Set(Nan::New(rc));
 }
 
-int ApoxUsbCan::SendBoardMessage(unsigned int command)
+NAN_METHOD(ApoxUsbCan::SetReassembly)
 {
-  unsigned char txFrameData[5];   
-  int txFrameLength = 0;
+  Nan::HandleScope scope;
 
-  txFrameData[txFrameLength++] = 0x00;
-  txFrameData[txFrameLength++] = command | 0x80;
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
 
-  return UsbWrite(txFrameData, txFrameLength);
-}
+  if (info.Length() < 1) {
+    Nan::ThrowError("Wrong number of arguments");
+    return;
+  }
 
-int ApoxUsbCan::SendCanBusMessage(bool rtr, unsigned int id, bool extendedId, unsigned char* data, int dataLength, unsigned int txFlags)
-{
-  unsigned char txFrameData[20];
-  int txFrameLength = 0;
+  if (!info[0]->IsBoolean()) {
+    Nan::ThrowError("Wrong argument type");
+    return;
+  }
 
-  // Outgoing CAN message
-  // --------------------
-  // [0] ([1][RTR][EXT][unused 0..4])
-  // [1] ID MSB
-  // [2] ID
-  // [3] ID
-  // [4] ID LSB
-  // [5] FUTURE USE (CANopen or DeviceNet) // ex. Wait for response? Etc..
-  // [6] FUTURE USE (CANopen or DeviceNet)
-  // [7] RESERVED FOR TX FLAGS 
-  // [8] DATA LEN (0-8)
-  // [9-16] DATA BYTES 0 to 8 (if needed) (NOT SENT IF RTR is SET)
+  bool enabled = Nan::To<bool>(info[0]).FromJust();
 
-  txFrameData[txFrameLength++] = 0x80 | (rtr ? 0x40 : 0x00) | (extendedId ? 0x20 : 0x00);
-  txFrameData[txFrameLength++] = (unsigned char)(id >> 24) & 0x1f;
-  txFrameData[txFrameLength++] = (unsigned char)(id >> 16) & 0xff;
-  txFrameData[txFrameLength++] = (unsigned char)(id >> 8) & 0xff;
-  txFrameData[txFrameLength++] = (unsigned char)(id) & 0xff;
-  txFrameData[txFrameLength++] = 0x00; // future use
-  txFrameData[txFrameLength++] = 0x00; // future use
-  txFrameData[txFrameLength++] = txFlags;
-  txFrameData[txFrameLength++] = dataLength;
+  // timeout, fastPacketPgns and emitFragments are optional
+  unsigned int timeout = J1939_REASSEMBLY_DEFAULT_TIMEOUT;
+  std::vector<unsigned int> fastPacketPgns;
+  bool emitFragments = false;
 
-  for (int i = 0; i < dataLength && i < 8; i++) {
-    txFrameData[txFrameLength++] = data[i];
+  if (info.Length() > 1 && !info[1]->IsUndefined()) {
+    if (!info[1]->IsNumber()) {
+      Nan::ThrowError("Wrong argument type");
+      return;
+    }
+    timeout = Nan::To<uint32_t>(info[1]).FromJust();
   }
 
-  return UsbWrite(txFrameData, txFrameLength);
-}
+  if (info.Length() > 2 && !info[2]->IsUndefined()) {
+    if (!info[2]->IsArray()) {
+      Nan::ThrowError("Wrong argument type");
+      return;
+    }
 
-ApoxUsbCan::ApoxUsbCan() : Nan::ObjectWrap()
-{
-  _opened = false;
-  _usbRead = false;
-  ftdi_init(&_ftdic);
-  uv_mutex_init(&_usbWriteMutex);
-  async_resource = new Nan::AsyncResource("ApoxUsbCan");
-}
+    v8::Local<v8::Array> pgns = info[2].As<v8::Array>();
+    for (uint32_t i = 0; i < pgns->Length(); i++) {
+      v8::Local<v8::Value> pgn = Nan::Get(pgns, i).ToLocalChecked();
+      if (!pgn->IsNumber()) {
+        Nan::ThrowError("Wrong argument type");
+        return;
+      }
+      fastPacketPgns.push_back(Nan::To<uint32_t>(pgn).FromJust());
+    }
+  }
 
-ApoxUsbCan::~ApoxUsbCan()
-{
-  uv_mutex_destroy(&_usbWriteMutex);
-  ftdi_deinit(&_ftdic);
-  delete async_resource;
+  if (info.Length() > 3 && !info[3]->IsUndefined()) {
+    emitFragments = Nan::To<bool>(info[3]).FromJust();
+  }
+
+  uv_mutex_lock(&input->_reassemblyMutex);
+  input->_reassembly = enabled;
+  input->_reassemblyEmitFragments = emitFragments;
+  input->_reassembler.SetTimeout(timeout);
+  input->_reassembler.SetFastPacketPgns(fastPacketPgns);
+  if (!enabled) {
+    input->_reassembler.Reset();
+  }
+  uv_mutex_unlock(&input->_reassemblyMutex);
+
+  info.GetReturnValue().SetUndefined();
 }
 
-void ApoxUsbCan::UsbReadThread(void* arg)
+NAN_METHOD(ApoxUsbCan::SetFlowControl)
 {
-  ApoxUsbCan *input = static_cast<ApoxUsbCan*>(arg);
+  Nan::HandleScope scope;
 
-  ReadFrameState rxFrameState = RX_FRAME_IDLE;
-  unsigned char rxFrameData[RX_FRAME_DATA_MAX_LENGTH];
-  int rxFrameLength = 0;
-  unsigned char rxFrameChecksum = 0;
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
 
-  while (input->_usbRead) {
-    unsigned char inByte = -1;
-    int bytesRead = 0;
+  if (info.Length() < 1) {
+    Nan::ThrowError("Wrong number of arguments");
+    return;
+  }
 
-    if ((bytesRead = ftdi_read_data(&input->_ftdic, &inByte, 1)) < 0) {
-      RAISE_USBCANERROR(input, "Failed to read USB data (%s, %d)", ftdi_get_error_string(&input->_ftdic), bytesRead);
-      continue;
-    }
+  if (!info[0]->IsNumber()) {
+    Nan::ThrowError("Wrong argument type");
+    return;
+  }
 
-    if (bytesRead == 0) {
-      continue;
+  unsigned int limit = Nan::To<uint32_t>(info[0]).FromJust();
+
+  // policy is optional: we assume the reader should block
+  unsigned int policy = FLOW_CONTROL_BLOCK;
+
+  if (info.Length() > 1 && !info[1]->IsUndefined()) {
+    if (!info[1]->IsNumber()) {
+      Nan::ThrowError("Wrong argument type");
+      return;
     }
 
-    // IMPORTANT: We assume we're in RUN mode. DOWNLOAD mode is unsupported.
-
-    // Process the byte and try to append to frame data.
-    // This section could have implemented with the state pattern, but
-    // it's a bit too much for this situation.
-
-    switch (rxFrameState) {
-      case RX_FRAME_IDLE:
-      case RX_FRAME_COMPLETE:
-      case RX_FRAME_ERROR_EXPECTING_DLE:
-      case RX_FRAME_ERROR_EXPECTING_STX:
-      case RX_FRAME_ERROR_EXPECTING_ETX:
-      case RX_FRAME_ERROR_BAD_CHECKSUM:
-      case RX_FRAME_ERROR_BUFFER_OVERFLOW:
-        if (inByte == USB_DLE) {
-          rxFrameState = RX_FRAME_START;
-          rxFrameChecksum = 0;
-          rxFrameLength = 0;
-        } else {
-          // Avoid raising with 0xff... for a strange reason, this byte is often thrown after switching to main
-          // code or resetting the device. XXX To investigate.
-          if (inByte != 0xff) {
-            RAISE_USBCANERROR(input, "Error reading USB data: Expecting a DLE byte. Dropping byte 0x%02X", inByte);
-          }
-          rxFrameState = RX_FRAME_ERROR_EXPECTING_DLE;
-        }
-        break;
-      case RX_FRAME_START:
-        if (inByte == USB_STX) {
-          rxFrameState = RX_FRAME_CONTENT;
-        } else {
-          RAISE_USBCANERROR(input, "Error reading USB data: Expecting a STX byte. Dropping byte 0x%02X", inByte);
-          rxFrameState = RX_FRAME_ERROR_EXPECTING_STX;
-        }
-        break;
-      case RX_FRAME_CONTENT:
-        if (inByte == USB_DLE) {
-          rxFrameState = RX_FRAME_CONTENT_NLE;
-        } else {
-          // We append content in frame buffer and computer checksum
-          if (rxFrameLength < RX_FRAME_DATA_MAX_LENGTH) {
-            rxFrameData[rxFrameLength] = inByte;
-            rxFrameChecksum ^= inByte;
-            rxFrameLength++;
-          } else {
-            RAISE_USBCANERROR(input, "Error reading USB data: Not enough space in buffer. Dropping byte 0x%02X", inByte);
-            rxFrameState = RX_FRAME_ERROR_BUFFER_OVERFLOW;
-          }
-        }
-        break;
-      case RX_FRAME_CONTENT_NLE:
-        if (inByte == USB_ETX) {
-          if (rxFrameChecksum == 0) { // checksum should be zero if message was good
-            rxFrameState = RX_FRAME_COMPLETE;
-            rxFrameLength--; // we are always 1 ahead
-          } else {
-            RAISE_USBCANERROR(input, "Error reading USB data: Bad frame checksum!");
-            rxFrameState = RX_FRAME_ERROR_BAD_CHECKSUM;
-          }
-        } else if (inByte == USB_STX) {
-          RAISE_USBCANERROR(input, "Error reading USB data: Expecting a ETX byte or content byte. Dropping byte 0x%02X", inByte);
-          rxFrameState = RX_FRAME_ERROR_EXPECTING_ETX;
-        } else {
-          // We append content in frame buffer and computer checksum
-          if (rxFrameLength < RX_FRAME_DATA_MAX_LENGTH) {
-            rxFrameData[rxFrameLength] = inByte;
-            rxFrameChecksum ^= inByte;
-            rxFrameLength++;
-            rxFrameState = RX_FRAME_CONTENT;
-          } else {
-            RAISE_USBCANERROR(input, "Error reading USB data: Not enough space in buffer. Dropping byte 0x%02X", inByte);
-            rxFrameState = RX_FRAME_ERROR_BUFFER_OVERFLOW;
-          }
-        }
-        break;
+    policy = Nan::To<uint32_t>(info[1]).FromJust();
+    if (policy > FLOW_CONTROL_DROP_NEWEST) {
+      Nan::ThrowError("Unknown flow control policy");
+      return;
     }
+  }
 
-    // Process complete frame
-    if (rxFrameState == RX_FRAME_COMPLETE) {
+  // A read thread blocked on a full queue can't send the auto responses nor poll the controller
+  if (limit > 0 && policy == FLOW_CONTROL_BLOCK) {
+    uv_mutex_lock(&input->_autoResponseMutex);
+    bool autoResponses = !input->_autoResponses.empty();
+    uv_mutex_unlock(&input->_autoResponseMutex);
 
-      if ((rxFrameData[0] == 0x00) || (rxFrameData[0] == 0xff)) {
-        // A frame from the USB-CAN board
-        BoardMessage* message = CreateBoardMessage(rxFrameData, rxFrameLength);
-        input->_boardMessageQueue.push(message);
-        uv_async_send(&input->_boardMessageEmitAsync);
-      } else {
-        // A frame from the CAN bus
-        CanBusMessage* message = CreateCanBusMessage(rxFrameData, rxFrameLength);
-        input->_canBusMessageQueue.push(message);
-        uv_async_send(&input->_canBusMessageEmitAsync);
-      }
+    if (autoResponses) {
+      Nan::ThrowError("The block policy can't be used with auto responses");
+      return;
+    }
 
-      rxFrameState = RX_FRAME_IDLE;
+    uv_mutex_lock(&input->_busMonitorMutex);
+    bool busMonitor = input->_busMonitor.IsEnabled();
+    uv_mutex_unlock(&input->_busMonitorMutex);
+
+    if (busMonitor) {
+      Nan::ThrowError("The block policy can't be used with the bus monitor");
+      return;
     }
   }
+
+  input->_canBusMessageQueue.SetFlowControl(limit, (FlowControlPolicy) policy);
+
+  info.GetReturnValue().SetUndefined();
 }
 
-void ApoxUsbCan::UsbCanErrorEmitter(uv_async_t* w)
+NAN_METHOD(ApoxUsbCan::PauseCanBusMessages)
 {
   Nan::HandleScope scope;
 
-  ApoxUsbCan* input = static_cast<ApoxUsbCan*>(w->data);
-  
-  while (!input->_usbCanErrorQueue.empty()) {
-    UsbCanError* error = input->_usbCanErrorQueue.front();
-
-    v8::Local<v8::Value> args[2];
-    args[0] = Nan::New("error").ToLocalChecked();
-    args[1] = Nan::New(error->message).ToLocalChecked();
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
 
-    input->async_resource->runInAsyncScope(input->handle(), "emit", 2, args);
+  input->_canBusMessageQueue.Pause();
 
-    input->_usbCanErrorQueue.pop();
-    delete error;
-  }
+  info.GetReturnValue().SetUndefined();
 }
 
-void ApoxUsbCan::BoardMessageEmitter(uv_async_t* w)
+NAN_METHOD(ApoxUsbCan::ResumeCanBusMessages)
 {
   Nan::HandleScope scope;
 
-  ApoxUsbCan* input = static_cast<ApoxUsbCan*>(w->data);
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
 
-  while (!input->_boardMessageQueue.empty()) {
-    BoardMessage* message = input->_boardMessageQueue.front();
+  bool paused = input->_canBusMessageQueue.Resume();
 
-    v8::Local<v8::Value> args[4];
-    args[0] = Nan::New("boardmessage").ToLocalChecked();
-    args[1] = Nan::New(message->id);
-    args[2] = Nan::New(message->command);
+  // Deliver what was queued while paused
+  if (paused && input->_opened) {
+    uv_async_send(&input->_canBusMessageEmitAsync);
+  }
 
-    if (message->dataLength > 0) {
-      args[3] = Nan::CopyBuffer((char*)message->data, message->dataLength).ToLocalChecked();
-    } else {
-      args[3] = Nan::Undefined();
-    }
+  info.GetReturnValue().SetUndefined();
+}
 
-    input->async_resource->runInAsyncScope(input->handle(), "emit", 4, args);
+NAN_METHOD(ApoxUsbCan::GetDroppedCanBusMessageCount)
+{
+  Nan::HandleScope scope;
 
-    input->_boardMessageQueue.pop();
-    delete message;
-  }
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
+
+  double count = (double) input->_canBusMessageQueue.GetDropCount();
+
+  info.GetReturnValue().Set(Nan::New(count));
 }
 
-void ApoxUsbCan::CanBusMessageEmitter(uv_async_t* w)
+NAN_METHOD(ApoxUsbCan::SetTrafficStats)
 {
   Nan::HandleScope scope;
 
-  ApoxUsbCan* input = static_cast<ApoxUsbCan*>(w->data);
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
 
-  while (!input->_canBusMessageQueue.empty()) {
-    CanBusMessage* message = input->_canBusMessageQueue.front();
+  if (info.Length() < 1) {
+    Nan::ThrowError("Wrong number of arguments");
+    return;
+  }
 
-    v8::Local<v8::Value> args[7];
-    args[0] = Nan::New("canbusmessage").ToLocalChecked();
-    args[1] = Nan::New(message->timestamp);
-    args[2] = Nan::New(message->rtr);
-    args[3] = Nan::New(message->id);
-    args[4] = Nan::New(message->extended);
-    args[5] = Nan::New(message->flags);
+  if (!info[0]->IsBoolean()) {
+    Nan::ThrowError("Wrong argument type");
+    return;
+  }
 
-    if (message->dataLength > 0) {
-      args[6] = Nan::CopyBuffer((char*)message->data, message->dataLength).ToLocalChecked();
-    } else {
-      args[6] = Nan::Undefined();
+  bool enabled = Nan::To<bool>(info[0]).FromJust();
+
+  // baudRate, window and timestampTick are optional. Without a baudRate, the last one sent to the board is kept.
+  unsigned int baudRate = 0;
+  unsigned int window = TRAFFIC_STATS_DEFAULT_WINDOW;
+  unsigned int timestampTick = TRAFFIC_STATS_DEFAULT_TIMESTAMP_TICK;
+
+  if (info.Length() > 1 && !info[1]->IsUndefined()) {
+    if (!info[1]->IsNumber()) {
+      Nan::ThrowError("Wrong argument type");
+      return;
     }
+    baudRate = Nan::To<uint32_t>(info[1]).FromJust();
+  }
 
-    input->async_resource->runInAsyncScope(input->handle(), "emit", 7, args);
+  if (info.Length() > 2 && !info[2]->IsUndefined()) {
+    if (!info[2]->IsNumber()) {
+      Nan::ThrowError("Wrong argument type");
+      return;
+    }
+    window = Nan::To<uint32_t>(info[2]).FromJust();
+  }
 
-    input->_canBusMessageQueue.pop();
-    delete message;
+  if (info.Length() > 3 && !info[3]->IsUndefined()) {
+    if (!info[3]->IsNumber()) {
+      Nan::ThrowError("Wrong argument type");
+      return;
+    }
+    timestampTick = Nan::To<uint32_t>(info[3]).FromJust();
   }
-}
 
-int ApoxUsbCan::UsbWrite(unsigned char *txFrameData, int txFrameLength) {
-  // USB message format
-  // ------------------
-  // [0] DLE
-  // [1] STX
-  // [2..n-3] data, but if data contains a DLE, then insert another DLE before it (BYTE Stuffing)
-  // [n-2] CSUM
-  // [n-1] DLE
-  // [n] ETX
-  uv_mutex_lock(&_usbWriteMutex);
+  uv_mutex_lock(&input->_trafficStatsMutex);
+  input->_trafficStatsEnabled = enabled;
+  input->_trafficStats.Configure(baudRate, window, timestampTick);
+  uv_mutex_unlock(&input->_trafficStatsMutex);
 
-  unsigned char txBuffer[300]; // XXX Possible buffer overflow, but OK for now (protected by callers)
-  int txLength = 0;
-  unsigned char txFrameChecksum = 0;
+  info.GetReturnValue().SetUndefined();
+}
 
-  // Start the transmission
-  txBuffer[txLength++] = USB_DLE;
-  txBuffer[txLength++] = USB_STX;  // start transmission
+NAN_METHOD(ApoxUsbCan::GetTrafficStats)
+{
+  Nan::HandleScope scope;
 
-  // BYTE Stuff the data and calculate checksum
-  for (int i = 0; i < txFrameLength; i++) {
-    txFrameChecksum ^= txFrameData[i];
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
 
-    if (txFrameData[i] == USB_DLE) {
-      txBuffer[txLength++] = USB_DLE;
-    }
-    txBuffer[txLength++] = txFrameData[i];
+  // Copy under the lock, build the JS object without holding up the read thread
+  TrafficStatsSnapshot snapshot;
+  uv_mutex_lock(&input->_trafficStatsMutex);
+  input->_trafficStats.Snapshot(uv_hrtime(), &snapshot);
+  uv_mutex_unlock(&input->_trafficStatsMutex);
+
+  v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+  Nan::Set(stats, Nan::New("baudRate").ToLocalChecked(), Nan::New(snapshot.baudRate));
+  Nan::Set(stats, Nan::New("window").ToLocalChecked(), Nan::New(snapshot.window));
+  Nan::Set(stats, Nan::New("frames").ToLocalChecked(), Nan::New((double) snapshot.frames));
+  Nan::Set(stats, Nan::New("bits").ToLocalChecked(), Nan::New((double) snapshot.bits));
+  Nan::Set(stats, Nan::New("busLoad").ToLocalChecked(), Nan::New(snapshot.busLoad));
+  Nan::Set(stats, Nan::New("peakBusLoad").ToLocalChecked(), Nan::New(snapshot.peakBusLoad));
+
+  v8::Local<v8::Array> dlc = Nan::New<v8::Array>(TRAFFIC_STATS_DLC_BUCKETS);
+  for (int i = 0; i < TRAFFIC_STATS_DLC_BUCKETS; i++) {
+    Nan::Set(dlc, (uint32_t) i, Nan::New((double) snapshot.dlc[i]));
   }
+  Nan::Set(stats, Nan::New("dlc").ToLocalChecked(), dlc);
+
+  // Intervals are reported in milliseconds
+  v8::Local<v8::Array> ids = Nan::New<v8::Array>((int) snapshot.ids.size());
+  for (size_t i = 0; i < snapshot.ids.size(); i++) {
+    IdTrafficStats& idStats = snapshot.ids[i];
+    uint64_t intervalCount = idStats.count - 1;
+
+    v8::Local<v8::Object> id = Nan::New<v8::Object>();
+    Nan::Set(id, Nan::New("id").ToLocalChecked(), Nan::New(idStats.id));
+    Nan::Set(id, Nan::New("extended").ToLocalChecked(), Nan::New(idStats.extended));
+    Nan::Set(id, Nan::New("count").ToLocalChecked(), Nan::New((double) idStats.count));
+    Nan::Set(id, Nan::New("rate").ToLocalChecked(), Nan::New(intervalCount > 0 && idStats.meanInterval > 0 ? 1e9 / idStats.meanInterval : 0));
+    Nan::Set(id, Nan::New("meanInterval").ToLocalChecked(), Nan::New(idStats.meanInterval / 1e6));
+    Nan::Set(id, Nan::New("minInterval").ToLocalChecked(), Nan::New(idStats.minInterval / 1e6));
+    Nan::Set(id, Nan::New("maxInterval").ToLocalChecked(), Nan::New(idStats.maxInterval / 1e6));
+    Nan::Set(id, Nan::New("jitter").ToLocalChecked(),
+             Nan::New(intervalCount > 1 ? sqrt(idStats.m2Interval / (intervalCount - 1)) / 1e6 : 0));
+
+    v8::Local<v8::Array> intervals = Nan::New<v8::Array>(TRAFFIC_STATS_INTERVAL_BUCKETS);
+    for (int j = 0; j < TRAFFIC_STATS_INTERVAL_BUCKETS; j++) {
+      Nan::Set(intervals, (uint32_t) j, Nan::New(idStats.intervals[j]));
+    }
+    Nan::Set(id, Nan::New("intervals").ToLocalChecked(), intervals);
 
-  // BYTE STUFF checksum if necessary
-  if (txFrameChecksum == USB_DLE) {
-    txBuffer[txLength++] = USB_DLE;
+    Nan::Set(ids, (uint32_t) i, id);
   }
+  Nan::Set(stats, Nan::New("ids").ToLocalChecked(), ids);
 
-  // Send the checksum
-  txBuffer[txLength++] = txFrameChecksum;
+  info.GetReturnValue().Set(stats);
+}
 
-  // Terminate the transmission
-  txBuffer[txLength++] = USB_DLE;
-  txBuffer[txLength++] = USB_ETX;  // end transmission
+NAN_METHOD(ApoxUsbCan::AddAutoResponseRule)
+{
+  Nan::HandleScope scope;
 
-  int rc = ftdi_write_data(&_ftdic, txBuffer, txLength);
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
 
-  uv_mutex_unlock(&_usbWriteMutex);
-  return rc; 
-}
+  // id, mask, extended, rtr, responseRtr, responseId, responseExtended, [responseData]
+  if (info.Length() < 7) {
+    Nan::ThrowError("Wrong number of arguments");
+    return;
+  }
 
-// ------ Message Factory Methods ------
+  if (!info[0]->IsNumber() || !info[1]->IsNumber() || !info[2]->IsBoolean() ||
+      !(info[3]->IsBoolean() || info[3]->IsUndefined() || info[3]->IsNull()) ||
+      !info[4]->IsBoolean() || !info[5]->IsNumber() || !info[6]->IsBoolean()) {
+    Nan::ThrowError("Wrong argument type");
+    return;
+  }
 
-BoardMessage* CreateBoardMessage(unsigned char* rxFrameData, int rxFrameLength)
-{
-  // Unsolicited Emergency Message from the board
-  // --------------------------------------------
-  // [0] 0xFF
-  // [1] 0x80
-  // [2] ERRORCODE (0-255)
-  //
-  // Response to config message from board
-  // -------------------------------------
-  // [0] 0x00
-  // [1] command | 0x80
-  // [2..n] response data               
+  AutoResponse response;
+  memset(&response, 0, sizeof response);
+  response.id = Nan::To<uint32_t>(info[0]).FromJust();
+  response.mask = Nan::To<uint32_t>(info[1]).FromJust();
+  response.extended = Nan::To<bool>(info[2]).FromJust();
+  response.rtr = info[3]->IsBoolean() ? (Nan::To<bool>(info[3]).FromJust() ? 1 : 0) : -1;
+  response.responseRtr = Nan::To<bool>(info[4]).FromJust();
+  response.responseId = Nan::To<uint32_t>(info[5]).FromJust();
+  response.responseExtended = Nan::To<bool>(info[6]).FromJust();
+
+  // responseData is optional: we assume empty buffer in this case
+  if (info.Length() > 7 && !info[7]->IsUndefined()) {
+    if (!Buffer::HasInstance(info[7])) {
+      Nan::ThrowError("Wrong argument type");
+      return;
+    }
 
-  BoardMessage* message = new BoardMessage;
-  message->id = rxFrameData[0];
-  message->command = rxFrameData[1] & 0x7f;
-  message->dataLength = rxFrameLength - 2; // minus two for the first two bytes
-  for (int i = 0; i < message->dataLength && i < (int) sizeof(message->data); i++) { 
-    message->data[i] = rxFrameData[i + 2];
+    v8::Local<v8::Object> data = Nan::To<v8::Object>(info[7]).ToLocalChecked();
+    response.responseDataLength = (int) Buffer::Length(data);
+
+    if (response.responseDataLength > 8) {
+      Nan::ThrowError("Too much data, maximum 8 bytes");
+      return;
+    }
+
+    memcpy(response.responseData, Buffer::Data(data), response.responseDataLength);
   }
 
-  return message;
+  if (input->_canBusMessageQueue.IsBlocking()) {
+    Nan::ThrowError("Auto responses can't be used with the block policy");
+    return;
+  }
+
+  uv_mutex_lock(&input->_autoResponseMutex);
+  response.rule = input->_nextAutoResponseRule++;
+  input->_autoResponses.push_back(response);
+  uv_mutex_unlock(&input->_autoResponseMutex);
+
+  info.GetReturnValue().Set(Nan::New(response.rule));
 }
 
-CanBusMessage* CreateCanBusMessage(unsigned char* rxFrameData, int rxFrameLength)
+NAN_METHOD(ApoxUsbCan::RemoveAutoResponse)
 {
-  // Incoming CAN Message
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
+
+  if (info.Length() < 1) {
+    Nan::ThrowError("Wrong number of arguments");
+    return;
+  }
+
+  if (!info[0]->IsNumber()) {
+    Nan::ThrowError("Wrong argument type");
+    return;
+  }
+
+  unsigned int rule = Nan::To<uint32_t>(info[0]).FromJust();
+  bool removed = false;
+
+  uv_mutex_lock(&input->_autoResponseMutex);
+  for (size_t i = 0; i < input->_autoResponses.size(); i++) {
+    if (input->_autoResponses[i].rule == rule) {
+      input->_autoResponses.erase(input->_autoResponses.begin() + i);
+      removed = true;
+      break;
+    }
+  }
+  uv_mutex_unlock(&input->_autoResponseMutex);
+
+  info.GetReturnValue().Set(Nan::New(removed));
+}
+
+NAN_METHOD(ApoxUsbCan::ClearAutoResponses)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
+
+  uv_mutex_lock(&input->_autoResponseMutex);
+  input->_autoResponses.clear();
+  uv_mutex_unlock(&input->_autoResponseMutex);
+
+  info.GetReturnValue().SetUndefined();
+}
+
+NAN_METHOD(ApoxUsbCan::GetAutoResponseStats)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
+
+  uv_mutex_lock(&input->_autoResponseMutex);
+  std::vector<AutoResponse> responses = input->_autoResponses;
+  uv_mutex_unlock(&input->_autoResponseMutex);
+
+  // Latencies are reported in microseconds
+  v8::Local<v8::Array> stats = Nan::New<v8::Array>((int) responses.size());
+  for (size_t i = 0; i < responses.size(); i++) {
+    AutoResponse& response = responses[i];
+    uint64_t sent = response.hits - response.failures;
+
+    v8::Local<v8::Object> rule = Nan::New<v8::Object>();
+    Nan::Set(rule, Nan::New("rule").ToLocalChecked(), Nan::New(response.rule));
+    Nan::Set(rule, Nan::New("hits").ToLocalChecked(), Nan::New((double) response.hits));
+    Nan::Set(rule, Nan::New("failures").ToLocalChecked(), Nan::New((double) response.failures));
+    Nan::Set(rule, Nan::New("minLatency").ToLocalChecked(), Nan::New(response.minLatency / 1e3));
+    Nan::Set(rule, Nan::New("meanLatency").ToLocalChecked(), Nan::New(sent > 0 ? response.totalLatency / 1e3 / sent : 0));
+    Nan::Set(rule, Nan::New("maxLatency").ToLocalChecked(), Nan::New(response.maxLatency / 1e3));
+
+    Nan::Set(stats, (uint32_t) i, rule);
+  }
+
+  info.GetReturnValue().Set(stats);
+}
+
+NAN_METHOD(ApoxUsbCan::SetRealtimeConfig)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
+
+  if (input->_opened) {
+    Nan::ThrowError("Device already opened");
+    return;
+  }
+
+  // cpu, policy, priority, lockMemory, busyPoll
+  if (info.Length() < 5) {
+    Nan::ThrowError("Wrong number of arguments");
+    return;
+  }
+
+  if (!info[0]->IsNumber() || !info[1]->IsNumber() || !(info[2]->IsNumber() || info[2]->IsUndefined()) ||
+      !info[3]->IsBoolean() || !info[4]->IsBoolean()) {
+    Nan::ThrowError("Wrong argument type");
+    return;
+  }
+
+  int policy = Nan::To<int32_t>(info[1]).FromJust();
+  if (policy < REALTIME_POLICY_NONE || policy > REALTIME_POLICY_RR) {
+    Nan::ThrowError("Unknown scheduling policy");
+    return;
+  }
+
+  // priority is optional: we assume the lowest real-time priority (0 is rejected by SCHED_FIFO and SCHED_RR)
+  int priority = 0;
+#ifndef _WIN32
+  if (policy != REALTIME_POLICY_NONE) {
+    int schedPolicy = policy == REALTIME_POLICY_FIFO ? SCHED_FIFO : SCHED_RR;
+    int minPriority = sched_get_priority_min(schedPolicy);
+    int maxPriority = sched_get_priority_max(schedPolicy);
+
+    priority = info[2]->IsUndefined() ? minPriority : Nan::To<int32_t>(info[2]).FromJust();
+    if (priority < minPriority || priority > maxPriority) {
+      char message[64];
+      snprintf(message, sizeof message, "Priority out of range (%d to %d)", minPriority, maxPriority);
+      Nan::ThrowError(message);
+      return;
+    }
+  }
+#endif
+
+  input->_realtimeConfig.cpu = Nan::To<int32_t>(info[0]).FromJust();
+  input->_realtimeConfig.policy = (RealtimePolicy) policy;
+  input->_realtimeConfig.priority = priority;
+  input->_realtimeConfig.lockMemory = Nan::To<bool>(info[3]).FromJust();
+  input->_realtimeConfig.busyPoll = Nan::To<bool>(info[4]).FromJust();
+
+#ifndef _WIN32
+  // The read thread would otherwise wait on a JS thread preempted while holding a lock it shares
+  if (policy != REALTIME_POLICY_NONE && !input->_priorityInheritance) {
+    InitPriorityInheritanceMutex(&input->_usbWriteMutex);
+    InitPriorityInheritanceMutex(&input->_reassemblyMutex);
+    InitPriorityInheritanceMutex(&input->_trafficStatsMutex);
+    InitPriorityInheritanceMutex(&input->_autoResponseMutex);
+    InitPriorityInheritanceMutex(&input->_readThreadStatsMutex);
+    InitPriorityInheritanceMutex(&input->_busMonitorMutex);
+    input->_priorityInheritance = true;
+  }
+#endif
+
+  info.GetReturnValue().SetUndefined();
+}
+
+NAN_METHOD(ApoxUsbCan::GetReadThreadStats)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
+
+  uv_mutex_lock(&input->_readThreadStatsMutex);
+  ReadThreadStats readThreadStats = input->_readThreadStats;
+  uv_mutex_unlock(&input->_readThreadStatsMutex);
+
+  // Times are reported in microseconds
+  double reads = (double) readThreadStats.reads;
+
+  v8::Local<v8::Object> stats = Nan::New<v8::Object>();
+  Nan::Set(stats, Nan::New("realtime").ToLocalChecked(), Nan::New(readThreadStats.realtime));
+  Nan::Set(stats, Nan::New("reads").ToLocalChecked(), Nan::New(reads));
+  Nan::Set(stats, Nan::New("bytes").ToLocalChecked(), Nan::New((double) readThreadStats.bytes));
+  Nan::Set(stats, Nan::New("fullReads").ToLocalChecked(), Nan::New((double) readThreadStats.fullReads));
+  Nan::Set(stats, Nan::New("meanInterval").ToLocalChecked(), Nan::New(reads > 0 ? readThreadStats.totalInterval / 1e3 / reads : 0));
+  Nan::Set(stats, Nan::New("maxInterval").ToLocalChecked(), Nan::New(readThreadStats.maxInterval / 1e3));
+  Nan::Set(stats, Nan::New("meanProcessing").ToLocalChecked(), Nan::New(reads > 0 ? readThreadStats.totalProcessing / 1e3 / reads : 0));
+  Nan::Set(stats, Nan::New("maxProcessing").ToLocalChecked(), Nan::New(readThreadStats.maxProcessing / 1e3));
+  Nan::Set(stats, Nan::New("involuntarySwitches").ToLocalChecked(), Nan::New((double) readThreadStats.involuntarySwitches));
+
+  v8::Local<v8::Array> intervals = Nan::New<v8::Array>(READ_THREAD_INTERVAL_BUCKETS);
+  for (int i = 0; i < READ_THREAD_INTERVAL_BUCKETS; i++) {
+    Nan::Set(intervals, (uint32_t) i, Nan::New(readThreadStats.intervals[i]));
+  }
+  Nan::Set(stats, Nan::New("intervals").ToLocalChecked(), intervals);
+
+  info.GetReturnValue().Set(stats);
+}
+
+NAN_METHOD(ApoxUsbCan::SetBusMonitor)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
+
+  if (info.Length() < 1) {
+    Nan::ThrowError("Wrong number of arguments");
+    return;
+  }
+
+  if (!info[0]->IsBoolean()) {
+    Nan::ThrowError("Wrong argument type");
+    return;
+  }
+
+  bool enabled = Nan::To<bool>(info[0]).FromJust();
+
+  // interval and autoRecover are optional
+  unsigned int interval = BUS_MONITOR_DEFAULT_INTERVAL;
+  bool autoRecover = false;
+
+  if (info.Length() > 1 && !info[1]->IsUndefined()) {
+    if (!info[1]->IsNumber()) {
+      Nan::ThrowError("Wrong argument type");
+      return;
+    }
+    interval = Nan::To<uint32_t>(info[1]).FromJust();
+  }
+
+  if (info.Length() > 2 && !info[2]->IsUndefined()) {
+    if (!info[2]->IsBoolean()) {
+      Nan::ThrowError("Wrong argument type");
+      return;
+    }
+    autoRecover = Nan::To<bool>(info[2]).FromJust();
+  }
+
+  if (enabled && input->_canBusMessageQueue.IsBlocking()) {
+    Nan::ThrowError("The bus monitor can't be used with the block policy");
+    return;
+  }
+
+  uv_mutex_lock(&input->_busMonitorMutex);
+  input->_busMonitor.Configure(enabled, interval, autoRecover);
+  uv_mutex_unlock(&input->_busMonitorMutex);
+
+  info.GetReturnValue().SetUndefined();
+}
+
+NAN_METHOD(ApoxUsbCan::GetBusState)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = Nan::ObjectWrap::Unwrap<ApoxUsbCan>(info.Holder());
+
+  uv_mutex_lock(&input->_busMonitorMutex);
+  BusStatus status = input->_busMonitor.GetStatus();
+  uv_mutex_unlock(&input->_busMonitorMutex);
+
+  v8::Local<v8::Object> state = Nan::New<v8::Object>();
+  Nan::Set(state, Nan::New("state").ToLocalChecked(), Nan::New(BusStateName(status.state)).ToLocalChecked());
+  Nan::Set(state, Nan::New("txErrorCount").ToLocalChecked(), Nan::New(status.txErrorCount));
+  Nan::Set(state, Nan::New("rxErrorCount").ToLocalChecked(), Nan::New(status.rxErrorCount));
+  Nan::Set(state, Nan::New("canstat").ToLocalChecked(), Nan::New(status.canstat));
+  Nan::Set(state, Nan::New("comstat").ToLocalChecked(), Nan::New(status.comstat));
+  Nan::Set(state, Nan::New("recoveries").ToLocalChecked(), Nan::New((double) status.recoveries));
+
+  info.GetReturnValue().Set(state);
+}
+
+int ApoxUsbCan::SendBoardMessage(unsigned int command)
+{
+  unsigned char txFrameData[5];   
+  int txFrameLength = 0;
+
+  // Keep the bus load estimation in sync with the baud rate of the board
+  unsigned int baudRate = 0;
+  switch (command) {
+    case SET_BAUD_1MEG: baudRate = 1000000; break;
+    case SET_BAUD_500K: baudRate = 500000; break;
+    case SET_BAUD_250K: baudRate = 250000; break;
+    case SET_BAUD_125K: baudRate = 125000; break;
+  }
+
+  if (baudRate > 0) {
+    uv_mutex_lock(&_trafficStatsMutex);
+    _trafficStats.SetBaudRate(baudRate);
+    uv_mutex_unlock(&_trafficStatsMutex);
+  }
+
+  txFrameData[txFrameLength++] = 0x00;
+  txFrameData[txFrameLength++] = command | 0x80;
+
+  return UsbWrite(txFrameData, txFrameLength);
+}
+
+int ApoxUsbCan::SendCanBusMessage(bool rtr, unsigned int id, bool extendedId, unsigned char* data, int dataLength, unsigned int txFlags)
+{
+  unsigned char txFrameData[20];
+  int txFrameLength = 0;
+
+  // Outgoing CAN message
   // --------------------
-  // [0] ([1][RTR][EXT][unused 0..4]) (WARNING: never send back 0xFF, its reserved for emergency)
+  // [0] ([1][RTR][EXT][unused 0..4])
   // [1] ID MSB
   // [2] ID
   // [3] ID
   // [4] ID LSB
-  // [5] TIMESTAMP MSB
-  // [6] TIMESTAMP 
-  // [7] TIMESTAMP 
-  // [8] TIMESTAMP LSB
-  // [9] RESERVED FOR RX FLAGS
-  // [10] DATA LEN (0-8)
-  // [11-18] DATA BYTES 0 to 8 (if needed)
-
-  CanBusMessage *message = new CanBusMessage;
-  message->rtr = (rxFrameData[0] & 0x40) ? true : false;
-  message->extended = (rxFrameData[0] & 0x20) ? true : false;
-  message->id = (((unsigned int) rxFrameData[4] << 24) & 0x1f000000) |
-                (((unsigned int) rxFrameData[3] << 16) & 0x00ff0000) |
-                (((unsigned int) rxFrameData[2] << 8) & 0x0000ff00) |
-                (((unsigned int) rxFrameData[1]) & 0x000000ff);
-  message->timestamp = (((unsigned int) rxFrameData[8] << 24) & 0xff000000) |
-                       (((unsigned int) rxFrameData[7] << 16) & 0x00ff0000) |
-                       (((unsigned int) rxFrameData[6] << 8) & 0x0000ff00) |
-                       (((unsigned int) rxFrameData[5]) & 0x000000ff);
-  message->flags = rxFrameData[9];
-
-  message->dataLength = rxFrameData[10]; // minus two for the first two bytes
-  for (int i = 0; i < message->dataLength && i < (int) sizeof(message->data); i++) { 
-    message->data[i] = rxFrameData[i + 11];
-  }
-
-  return message;
+  // [5] FUTURE USE (CANopen or DeviceNet) // ex. Wait for response? Etc..
+  // [6] FUTURE USE (CANopen or DeviceNet)
+  // [7] RESERVED FOR TX FLAGS 
+  // [8] DATA LEN (0-8)
+  // [9-16] DATA BYTES 0 to 8 (if needed) (NOT SENT IF RTR is SET)
+
+  txFrameData[txFrameLength++] = 0x80 | (rtr ? 0x40 : 0x00) | (extendedId ? 0x20 : 0x00);
+  txFrameData[txFrameLength++] = (unsigned char)(id >> 24) & 0x1f;
+  txFrameData[txFrameLength++] = (unsigned char)(id >> 16) & 0xff;
+  txFrameData[txFrameLength++] = (unsigned char)(id >> 8) & 0xff;
+  txFrameData[txFrameLength++] = (unsigned char)(id) & 0xff;
+  txFrameData[txFrameLength++] = 0x00; // future use
+  txFrameData[txFrameLength++] = 0x00; // future use
+  txFrameData[txFrameLength++] = txFlags;
+  txFrameData[txFrameLength++] = dataLength;
+
+  for (int i = 0; i < dataLength && i < 8; i++) {
+    txFrameData[txFrameLength++] = data[i];
+  }
+
+  return UsbWrite(txFrameData, txFrameLength);
+}
+
+ApoxUsbCan::ApoxUsbCan() : Nan::ObjectWrap()
+{
+  _opened = false;
+  _usbRead = false;
+  _reassembly = false;
+  _reassemblyEmitFragments = false;
+  _trafficStatsEnabled = false;
+  _nextAutoResponseRule = 1;
+  _realtimeConfig.cpu = -1;
+  _realtimeConfig.policy = REALTIME_POLICY_NONE;
+  _realtimeConfig.priority = 0;
+  _realtimeConfig.lockMemory = false;
+  _realtimeConfig.busyPoll = false;
+  _busyPollTransfer = NULL;
+  _priorityInheritance = false;
+  memset(&_readThreadStats, 0, sizeof _readThreadStats);
+  ftdi_init(&_ftdic);
+  uv_mutex_init(&_usbWriteMutex);
+  uv_mutex_init(&_reassemblyMutex);
+  uv_mutex_init(&_trafficStatsMutex);
+  uv_mutex_init(&_autoResponseMutex);
+  uv_mutex_init(&_readThreadStatsMutex);
+  uv_mutex_init(&_busMonitorMutex);
+  async_resource = new Nan::AsyncResource("ApoxUsbCan");
+}
+
+ApoxUsbCan::~ApoxUsbCan()
+{
+  uv_mutex_destroy(&_usbWriteMutex);
+  uv_mutex_destroy(&_reassemblyMutex);
+  uv_mutex_destroy(&_trafficStatsMutex);
+  uv_mutex_destroy(&_autoResponseMutex);
+  uv_mutex_destroy(&_readThreadStatsMutex);
+  uv_mutex_destroy(&_busMonitorMutex);
+  ftdi_deinit(&_ftdic);
+  delete async_resource;
+}
+
+void ApoxUsbCan::UsbReadThread(void* arg)
+{
+  ApoxUsbCan *input = static_cast<ApoxUsbCan*>(arg);
+
+  input->ApplyRealtimeConfig();
+
+  // libftdi's read buffer and the messages, PGN messages and statistics allocated for every frame
+  // are touched too: the whole process is locked, including what is mapped later on
+#ifndef _WIN32
+  if (input->_realtimeConfig.lockMemory) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      RAISE_USBCANERROR(input, "Unable to lock the process memory (%s)", strerror(errno));
+    }
+  }
+#endif
+
+  // Preallocated and touched before the first read
+  UsbFrameDecoder* rxFrame = new UsbFrameDecoder;
+  unsigned char* rxBuffer = new unsigned char[RX_READ_BUFFER_LENGTH];
+  InitUsbFrameDecoder(rxFrame);
+  memset(rxBuffer, 0, RX_READ_BUFFER_LENGTH);
+
+  if (input->_realtimeConfig.busyPoll) {
+    input->_busyPollTransfer = libusb_alloc_transfer(0);
+  }
+
+  uint64_t lastRead = uv_hrtime();
+  unsigned int readErrors = 0; // consecutive
+
+  while (input->_usbRead) {
+    int bytesRead = input->ReadUsbData(rxBuffer, RX_READ_BUFFER_LENGTH);
+
+    // The data arrived when the read returned: frames are timed from here
+    uint64_t now = uv_hrtime();
+
+    input->RecordUsbRead(bytesRead, now - lastRead);
+    lastRead = now;
+
+    // The read returns at least every latency timer period, often enough to poll the controller
+    input->PollBusMonitor(now);
+
+    if (bytesRead < 0) {
+      RAISE_USBCANERROR(input, "Failed to read USB data (%s, %d)",
+                        input->_realtimeConfig.busyPoll ? libusb_error_name(bytesRead) : ftdi_get_error_string(&input->_ftdic),
+                        bytesRead);
+
+      // A failing device fails right away: don't spin, a real-time thread would starve the CPU
+      uv_sleep(readErrors < 7 ? 1 << readErrors : READ_ERROR_BACKOFF_MAX);
+      readErrors++;
+      continue;
+    }
+
+    readErrors = 0;
+
+    for (int i = 0; i < bytesRead; i++) {
+      unsigned char inByte = rxBuffer[i];
+
+      switch (DecodeUsbByte(rxFrame, inByte)) {
+        case RX_FRAME_ERROR_EXPECTING_DLE:
+          // Avoid raising with 0xff... for a strange reason, this byte is often thrown after switching to main
+          // code or resetting the device. XXX To investigate.
+          if (inByte != 0xff) {
+            RAISE_USBCANERROR(input, "Error reading USB data: Expecting a DLE byte. Dropping byte 0x%02X", inByte);
+          }
+          break;
+        case RX_FRAME_ERROR_EXPECTING_STX: {
+          RAISE_USBCANERROR(input, "Error reading USB data: Expecting a STX byte. Dropping byte 0x%02X", inByte);
+          break;
+        }
+        case RX_FRAME_ERROR_EXPECTING_ETX: {
+          RAISE_USBCANERROR(input, "Error reading USB data: Expecting a ETX byte or content byte. Dropping byte 0x%02X", inByte);
+          break;
+        }
+        case RX_FRAME_ERROR_BAD_CHECKSUM: {
+          RAISE_USBCANERROR(input, "Error reading USB data: Bad frame checksum!");
+          break;
+        }
+        case RX_FRAME_ERROR_BUFFER_OVERFLOW: {
+          RAISE_USBCANERROR(input, "Error reading USB data: Not enough space in buffer. Dropping byte 0x%02X", inByte);
+          break;
+        }
+        default:
+          break;
+      }
+
+      // Process complete frame
+      if (rxFrame->state == RX_FRAME_COMPLETE) {
+
+        if ((rxFrame->data[0] == 0x00) || (rxFrame->data[0] == 0xff)) {
+          // A frame from the USB-CAN board
+          BoardMessage* message = CreateBoardMessage(rxFrame->data, rxFrame->length);
+
+          // Replies to the bus monitor are not emitted
+          if (input->ProcessBusMonitorReply(message)) {
+            delete message;
+          } else {
+            input->_boardMessageQueue.push(message);
+            uv_async_send(&input->_boardMessageEmitAsync);
+          }
+        } else {
+          // A frame from the CAN bus
+          CanBusMessage* message = CreateCanBusMessage(rxFrame->data, rxFrame->length);
+
+          // Answer right away, before anything else is done with the frame
+          input->RespondToCanBusMessage(message, now);
+
+          uv_mutex_lock(&input->_trafficStatsMutex);
+          if (input->_trafficStatsEnabled) {
+            input->_trafficStats.Record(message->id, message->extended, message->rtr, message->data, message->dataLength,
+                                        message->timestamp, uv_hrtime());
+          }
+          uv_mutex_unlock(&input->_trafficStatsMutex);
+
+          // J1939 transport and NMEA 2000 fast-packet fragments are reassembled here when enabled
+          if (message->extended && !message->rtr) {
+            PgnMessage* pgnMessage = NULL;
+            bool fragment = false;
+
+            uv_mutex_lock(&input->_reassemblyMutex);
+            if (input->_reassembly) {
+              fragment = input->_reassembler.Process(message->id, message->timestamp, message->data, message->dataLength,
+                                                     uv_hrtime() / 1000000, &pgnMessage);
+              fragment = fragment && !input->_reassemblyEmitFragments;
+            }
+            if (pgnMessage) {
+              input->_pgnMessageQueue.push(pgnMessage);
+            }
+            uv_mutex_unlock(&input->_reassemblyMutex);
+
+            if (pgnMessage) {
+              uv_async_send(&input->_pgnMessageEmitAsync);
+            }
+
+            if (fragment) {
+              delete message;
+              message = NULL;
+            }
+          }
+
+          if (message) {
+            if (input->_canBusMessageQueue.Push(message)) {
+              uv_async_send(&input->_canBusMessageEmitAsync);
+            }
+          }
+        }
+
+        rxFrame->state = RX_FRAME_IDLE;
+      }
+    }
+
+    input->RecordUsbProcessing(uv_hrtime() - now);
+  }
+
+  if (input->_busyPollTransfer) {
+    libusb_free_transfer(input->_busyPollTransfer);
+    input->_busyPollTransfer = NULL;
+  }
+
+  delete rxFrame;
+  delete[] rxBuffer;
+
+#ifndef _WIN32
+  if (input->_realtimeConfig.lockMemory) {
+    munlockall();
+  }
+#endif
+}
+
+#ifndef _WIN32
+void ApoxUsbCan::InitPriorityInheritanceMutex(uv_mutex_t* mutex)
+{
+  // uv_mutex_t is a pthread_mutex_t, only used by this thread while the device is closed
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+
+  uv_mutex_destroy(mutex);
+  if (pthread_mutex_init(mutex, &attr) != 0) {
+    uv_mutex_init(mutex);
+  }
+
+  pthread_mutexattr_destroy(&attr);
+}
+#endif
+
+void ApoxUsbCan::ApplyRealtimeConfig()
+{
+#ifndef _WIN32
+  if (_realtimeConfig.cpu >= 0) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(_realtimeConfig.cpu, &cpus);
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+    if (rc != 0) {
+      RAISE_USBCANERROR(this, "Unable to set the read thread CPU affinity (%s)", strerror(rc));
+    }
+#else
+    RAISE_USBCANERROR(this, "Unable to set the read thread CPU affinity: not supported on this platform");
+#endif
+  }
+
+  if (_realtimeConfig.policy != REALTIME_POLICY_NONE) {
+    struct sched_param param;
+    memset(&param, 0, sizeof param);
+    param.sched_priority = _realtimeConfig.priority;
+
+    int rc = pthread_setschedparam(pthread_self(), _realtimeConfig.policy == REALTIME_POLICY_FIFO ? SCHED_FIFO : SCHED_RR, &param);
+    if (rc != 0) {
+      RAISE_USBCANERROR(this, "Unable to set the read thread real-time scheduling (%s)", strerror(rc));
+    } else {
+      uv_mutex_lock(&_readThreadStatsMutex);
+      _readThreadStats.realtime = true;
+      uv_mutex_unlock(&_readThreadStatsMutex);
+    }
+  }
+#else
+  if (_realtimeConfig.cpu >= 0 || _realtimeConfig.policy != REALTIME_POLICY_NONE || _realtimeConfig.lockMemory) {
+    RAISE_USBCANERROR(this, "Real-time mode is not supported on this platform");
+  }
+#endif
+}
+
+int ApoxUsbCan::ReadUsbData(unsigned char* rxBuffer, int rxBufferLength)
+{
+  if (_realtimeConfig.busyPoll) {
+    return BusyPollUsbData(rxBuffer, rxBufferLength);
+  }
+
+  // ftdi_read_data only returns once the buffer is full, or after a packet without data. Ask for one
+  // byte: it returns with the first USB transfer carrying data, and keeps the rest of it buffered.
+  int bytesRead = ftdi_read_data(&_ftdic, rxBuffer, 1);
+  if (bytesRead <= 0) {
+    return bytesRead;
+  }
+
+  // Served from the libftdi buffer, without another transfer
+  int remaining = (int) _ftdic.readbuffer_remaining;
+  if (remaining > rxBufferLength - 1) {
+    remaining = rxBufferLength - 1;
+  }
+
+  if (remaining > 0) {
+    int rc = ftdi_read_data(&_ftdic, rxBuffer + 1, remaining);
+    if (rc < 0) {
+      return rc;
+    }
+    bytesRead += rc;
+  }
+
+  return bytesRead;
+}
+
+static void BusyPollTransferDone(struct libusb_transfer* transfer)
+{
+  *static_cast<int*>(transfer->user_data) = 1;
+}
+
+int ApoxUsbCan::BusyPollUsbData(unsigned char* rxBuffer, int rxBufferLength)
+{
+  // libftdi's asynchronous reads sleep in libusb and resubmit until the buffer is full, so the bulk
+  // transfer is handled here: polled without ever sleeping, and cancelled when the device is closed
+  if (_busyPollTransfer == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+
+  int completed = 0;
+  libusb_fill_bulk_transfer(_busyPollTransfer, _ftdic.usb_dev, _ftdic.out_ep, rxBuffer, rxBufferLength,
+                            BusyPollTransferDone, &completed, 0);
+
+  int rc = libusb_submit_transfer(_busyPollTransfer);
+  if (rc < 0) {
+    return rc;
+  }
+
+  struct timeval zero = { 0, 0 };
+  bool cancelled = false;
+
+  // The transfer belongs to libusb until completed, even when cancelled
+  while (!completed) {
+    if (!_usbRead && !cancelled) {
+      libusb_cancel_transfer(_busyPollTransfer);
+      cancelled = true;
+    }
+
+    libusb_handle_events_timeout_completed(_ftdic.usb_ctx, &zero, &completed);
+  }
+
+  if (_busyPollTransfer->status == LIBUSB_TRANSFER_CANCELLED) {
+    return 0;
+  }
+
+  if (_busyPollTransfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    return LIBUSB_ERROR_IO;
+  }
+
+  // Every packet starts with two modem status bytes
+  int length = _busyPollTransfer->actual_length;
+  int packetSize = (int) _ftdic.max_packet_size;
+  int bytesRead = 0;
+
+  for (int offset = 0; offset < length; offset += packetSize) {
+    int payload = (length - offset < packetSize ? length - offset : packetSize) - 2;
+    if (payload > 0) {
+      memmove(rxBuffer + bytesRead, rxBuffer + offset + 2, payload);
+      bytesRead += payload;
+    }
+  }
+
+  return bytesRead;
+}
+
+void ApoxUsbCan::RecordUsbRead(int bytesRead, uint64_t interval)
+{
+  uv_mutex_lock(&_readThreadStatsMutex);
+
+  _readThreadStats.reads++;
+  if (bytesRead > 0) {
+    _readThreadStats.bytes += bytesRead;
+  }
+  // Status bytes are stripped from every packet of the transfer
+  int packetSize = (int) _ftdic.max_packet_size;
+  if (packetSize > 0 && bytesRead >= RX_READ_BUFFER_LENGTH - 2 * (RX_READ_BUFFER_LENGTH / packetSize)) {
+    _readThreadStats.fullReads++;
+  }
+
+  _readThreadStats.totalInterval += interval;
+  if (interval > _readThreadStats.maxInterval) {
+    _readThreadStats.maxInterval = interval;
+  }
+
+  int bucket = 0;
+  for (uint64_t us = interval / 1000; us > 1 && bucket < READ_THREAD_INTERVAL_BUCKETS - 1; us >>= 1) {
+    bucket++;
+  }
+  _readThreadStats.intervals[bucket]++;
+
+#ifdef __linux__
+  // Only the thread itself can ask for its own usage, once in a while is enough
+  if ((_readThreadStats.reads & 0x3ff) == 1) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+      _readThreadStats.involuntarySwitches = usage.ru_nivcsw;
+    }
+  }
+#endif
+
+  uv_mutex_unlock(&_readThreadStatsMutex);
+}
+
+void ApoxUsbCan::RecordUsbProcessing(uint64_t processing)
+{
+  uv_mutex_lock(&_readThreadStatsMutex);
+
+  _readThreadStats.totalProcessing += processing;
+  if (processing > _readThreadStats.maxProcessing) {
+    _readThreadStats.maxProcessing = processing;
+  }
+
+  uv_mutex_unlock(&_readThreadStatsMutex);
+}
+
+void ApoxUsbCan::UsbCanErrorEmitter(uv_async_t* w)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = static_cast<ApoxUsbCan*>(w->data);
+  
+  while (!input->_usbCanErrorQueue.empty()) {
+    UsbCanError* error = input->_usbCanErrorQueue.front();
+
+    v8::Local<v8::Value> args[2];
+    args[0] = Nan::New("error").ToLocalChecked();
+    args[1] = Nan::New(error->message).ToLocalChecked();
+
+    input->async_resource->runInAsyncScope(input->handle(), "emit", 2, args);
+
+    input->_usbCanErrorQueue.pop();
+    delete error;
+  }
+}
+
+void ApoxUsbCan::BoardMessageEmitter(uv_async_t* w)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = static_cast<ApoxUsbCan*>(w->data);
+
+  while (!input->_boardMessageQueue.empty()) {
+    BoardMessage* message = input->_boardMessageQueue.front();
+
+    v8::Local<v8::Value> args[4];
+    args[0] = Nan::New("boardmessage").ToLocalChecked();
+    args[1] = Nan::New(message->id);
+    args[2] = Nan::New(message->command);
+
+    if (message->dataLength > 0) {
+      args[3] = Nan::CopyBuffer((char*)message->data, message->dataLength).ToLocalChecked();
+    } else {
+      args[3] = Nan::Undefined();
+    }
+
+    input->async_resource->runInAsyncScope(input->handle(), "emit", 4, args);
+
+    input->_boardMessageQueue.pop();
+    delete message;
+  }
+}
+
+void ApoxUsbCan::CanBusMessageEmitter(uv_async_t* w)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = static_cast<ApoxUsbCan*>(w->data);
+
+  CanBusMessage* message;
+  while ((message = input->_canBusMessageQueue.Pop()) != NULL) {
+    v8::Local<v8::Value> args[7];
+    args[0] = Nan::New("canbusmessage").ToLocalChecked();
+    args[1] = Nan::New(message->timestamp);
+    args[2] = Nan::New(message->rtr);
+    args[3] = Nan::New(message->id);
+    args[4] = Nan::New(message->extended);
+    args[5] = Nan::New(message->flags);
+
+    if (message->dataLength > 0) {
+      args[6] = Nan::CopyBuffer((char*)message->data, message->dataLength).ToLocalChecked();
+    } else {
+      args[6] = Nan::Undefined();
+    }
+
+    input->async_resource->runInAsyncScope(input->handle(), "emit", 7, args);
+
+    delete message;
+  }
+}
+
+void ApoxUsbCan::PgnMessageEmitter(uv_async_t* w)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = static_cast<ApoxUsbCan*>(w->data);
+
+  while (true) {
+    uv_mutex_lock(&input->_reassemblyMutex);
+    if (input->_pgnMessageQueue.empty()) {
+      uv_mutex_unlock(&input->_reassemblyMutex);
+      break;
+    }
+    PgnMessage* message = input->_pgnMessageQueue.front();
+    input->_pgnMessageQueue.pop();
+    uv_mutex_unlock(&input->_reassemblyMutex);
+
+    v8::Local<v8::Value> args[7];
+    args[0] = Nan::New("pgnmessage").ToLocalChecked();
+    args[1] = Nan::New(message->timestamp);
+    args[2] = Nan::New(message->priority);
+    args[3] = Nan::New(message->pgn);
+    args[4] = Nan::New(message->source);
+    args[5] = Nan::New(message->destination);
+
+    if (message->dataLength > 0) {
+      args[6] = Nan::CopyBuffer((char*)message->data, message->dataLength).ToLocalChecked();
+    } else {
+      args[6] = Nan::Undefined();
+    }
+
+    input->async_resource->runInAsyncScope(input->handle(), "emit", 7, args);
+
+    input->_reassembler.Release(message);
+  }
+}
+
+void ApoxUsbCan::BusStateEmitter(uv_async_t* w)
+{
+  Nan::HandleScope scope;
+
+  ApoxUsbCan* input = static_cast<ApoxUsbCan*>(w->data);
+
+  while (true) {
+    uv_mutex_lock(&input->_busMonitorMutex);
+    if (input->_busStateQueue.empty()) {
+      uv_mutex_unlock(&input->_busMonitorMutex);
+      break;
+    }
+    BusStatus* status = input->_busStateQueue.front();
+    input->_busStateQueue.pop();
+    uv_mutex_unlock(&input->_busMonitorMutex);
+
+    v8::Local<v8::Value> args[4];
+    args[0] = Nan::New("busstate").ToLocalChecked();
+    args[1] = Nan::New(BusStateName(status->state)).ToLocalChecked();
+    args[2] = Nan::New(status->txErrorCount);
+    args[3] = Nan::New(status->rxErrorCount);
+
+    input->async_resource->runInAsyncScope(input->handle(), "emit", 4, args);
+
+    delete status;
+  }
+}
+
+void ApoxUsbCan::RespondToCanBusMessage(CanBusMessage* message, uint64_t receivedAt)
+{
+  // Copied out, the lock isn't held while writing to the device
+  std::vector<AutoResponse>& matches = _autoResponseMatches;
+  matches.clear();
+
+  uv_mutex_lock(&_autoResponseMutex);
+  for (size_t i = 0; i < _autoResponses.size(); i++) {
+    AutoResponse& response = _autoResponses[i];
+
+    if (((message->id ^ response.id) & response.mask) == 0 && message->extended == response.extended &&
+        (response.rtr < 0 || message->rtr == (response.rtr == 1))) {
+      matches.push_back(response);
+    }
+  }
+  uv_mutex_unlock(&_autoResponseMutex);
+
+  if (matches.empty()) {
+    return;
+  }
+
+  // The outcome of each response is kept in failures and totalLatency of the copy
+  for (size_t i = 0; i < matches.size(); i++) {
+    AutoResponse& match = matches[i];
+
+    if (SendCanBusMessage(match.responseRtr, match.responseId, match.responseExtended,
+                          match.responseData, match.responseDataLength, 0x00) < 0) {
+      RAISE_USBCANERROR(this, "Failed to send auto response of rule %u (%s)", match.rule, ftdi_get_error_string(&_ftdic));
+      match.failures = 1;
+      continue;
+    }
+
+    match.failures = 0;
+    match.totalLatency = uv_hrtime() - receivedAt;
+  }
+
+  uv_mutex_lock(&_autoResponseMutex);
+  for (size_t i = 0; i < matches.size(); i++) {
+    AutoResponse& match = matches[i];
+
+    // The rule may have been removed meanwhile
+    for (size_t j = 0; j < _autoResponses.size(); j++) {
+      AutoResponse& response = _autoResponses[j];
+      if (response.rule != match.rule) {
+        continue;
+      }
+
+      response.hits++;
+
+      if (match.failures > 0) {
+        response.failures++;
+        break;
+      }
+
+      uint64_t latency = match.totalLatency;
+      if (response.hits - response.failures == 1 || latency < response.minLatency) {
+        response.minLatency = latency;
+      }
+      if (latency > response.maxLatency) {
+        response.maxLatency = latency;
+      }
+      response.totalLatency += latency;
+      break;
+    }
+  }
+  uv_mutex_unlock(&_autoResponseMutex);
+}
+
+void ApoxUsbCan::PollBusMonitor(uint64_t now)
+{
+  unsigned int commands[BUS_MONITOR_COMMANDS];
+
+  uv_mutex_lock(&_busMonitorMutex);
+  int count = _busMonitor.Poll(now, commands);
+  uv_mutex_unlock(&_busMonitorMutex);
+
+  for (int i = 0; i < count; i++) {
+    if (SendBoardMessage(commands[i]) < 0) {
+      RAISE_USBCANERROR(this, "Failed to poll the CAN controller status (%s)", ftdi_get_error_string(&_ftdic));
+      break;
+    }
+  }
+}
+
+bool ApoxUsbCan::ProcessBusMonitorReply(BoardMessage* message)
+{
+  if (message->id != 0x00) {
+    return false;
+  }
+
+  bool changed = false;
+  bool recover = false;
+
+  uv_mutex_lock(&_busMonitorMutex);
+
+  bool consumed = _busMonitor.ProcessReply(message->command, message->data, message->dataLength, &changed, &recover);
+  if (changed) {
+    _busStateQueue.push(new BusStatus(_busMonitor.GetStatus()));
+  }
+
+  uv_mutex_unlock(&_busMonitorMutex);
+
+  if (changed) {
+    uv_async_send(&_busStateEmitAsync);
+  }
+
+  // Going through configuration mode resets the error counters and brings the controller back on the bus
+  if (recover && (SendBoardMessage(SET_CONFIG_MODE) < 0 || SendBoardMessage(SET_NORMAL_MODE) < 0)) {
+    RAISE_USBCANERROR(this, "Failed to recover from bus-off (%s)", ftdi_get_error_string(&_ftdic));
+  }
+
+  return consumed;
+}
+
+int ApoxUsbCan::UsbWrite(unsigned char *txFrameData, int txFrameLength) {
+  uv_mutex_lock(&_usbWriteMutex);
+
+  unsigned char txBuffer[300]; // XXX Possible buffer overflow, but OK for now (protected by callers)
+  int txLength = EncodeUsbFrame(txFrameData, txFrameLength, txBuffer);
+
+  int rc = ftdi_write_data(&_ftdic, txBuffer, txLength);
+
+  uv_mutex_unlock(&_usbWriteMutex);
+  return rc; 
 }
\ No newline at end of file
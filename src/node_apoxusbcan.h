@@ -26,27 +26,70 @@
 
 #include <ftdi.h>
 #include <queue>
+#include <vector>
+
+#include "bus_monitor.h"
+#include "canbus_message_queue.h"
+#include "j1939_reassembler.h"
+#include "traffic_stats.h"
+#include "usbcan_frame.h"
 
 typedef struct { 
   char message[512];
 } UsbCanError;
 
-typedef struct {  
+// A frame sent by the read thread as soon as a matching frame is received
+typedef struct {
+  unsigned int rule;
+
+  // Trigger: (id & mask) == (trigger id & mask)
   unsigned int id;
-  unsigned int command;
-  unsigned char data[255];
-  int dataLength;
-} BoardMessage;
+  unsigned int mask;
+  bool extended;
+  int rtr; // 0 = data frame, 1 = remote frame, -1 = any
+
+  bool responseRtr;
+  unsigned int responseId;
+  bool responseExtended;
+  unsigned char responseData[8];
+  int responseDataLength;
+
+  uint64_t hits;
+  uint64_t failures;
+  uint64_t minLatency; // nanoseconds, from the USB transfer carrying the frame completing to the response being written
+  uint64_t maxLatency;
+  uint64_t totalLatency;
+} AutoResponse;
+
+enum RealtimePolicy {
+  REALTIME_POLICY_NONE, // default scheduling
+  REALTIME_POLICY_FIFO,
+  REALTIME_POLICY_RR
+};
 
+// Applied to the USB read thread when the device is opened
 typedef struct {
-  unsigned int id;
-  bool rtr; // remote transmission request (RTR)
-  bool extended; // false = 11 bit identifier, true = 29 bit identifier
-  unsigned int timestamp;
-  unsigned char data[255]; // XXX 8 bytes only?
-  int dataLength;
-  unsigned int flags;
-} CanBusMessage;
+  int cpu; // -1 = any
+  RealtimePolicy policy;
+  int priority;
+  bool lockMemory;
+  bool busyPoll;
+} RealtimeConfig;
+
+#define READ_THREAD_INTERVAL_BUCKETS 24 // log2 of the time between reads in microseconds
+
+typedef struct {
+  bool realtime; // real-time scheduling was applied
+  uint64_t reads;
+  uint64_t bytes;
+  uint64_t fullReads; // reads of a whole USB transfer: more data was probably waiting
+  uint64_t totalInterval; // nanoseconds between two reads returning, processing included
+  uint64_t maxInterval;
+  unsigned int intervals[READ_THREAD_INTERVAL_BUCKETS];
+  uint64_t totalProcessing; // nanoseconds spent on the data of a read
+  uint64_t maxProcessing;
+  long involuntarySwitches;
+} ReadThreadStats;
 
 class ApoxUsbCan : public Nan::ObjectWrap
 {
@@ -59,6 +102,21 @@ public:
   static NAN_METHOD(SendBoardMessage);
   static NAN_METHOD(SendCanBusMessage);
   static NAN_METHOD(UsbWrite);
+  static NAN_METHOD(SetReassembly);
+  static NAN_METHOD(SetFlowControl);
+  static NAN_METHOD(PauseCanBusMessages);
+  static NAN_METHOD(ResumeCanBusMessages);
+  static NAN_METHOD(GetDroppedCanBusMessageCount);
+  static NAN_METHOD(SetTrafficStats);
+  static NAN_METHOD(GetTrafficStats);
+  static NAN_METHOD(AddAutoResponseRule);
+  static NAN_METHOD(RemoveAutoResponse);
+  static NAN_METHOD(ClearAutoResponses);
+  static NAN_METHOD(GetAutoResponseStats);
+  static NAN_METHOD(SetRealtimeConfig);
+  static NAN_METHOD(GetReadThreadStats);
+  static NAN_METHOD(SetBusMonitor);
+  static NAN_METHOD(GetBusState);
 
   ApoxUsbCan();
   ~ApoxUsbCan();
@@ -78,7 +136,35 @@ protected:
   std::queue<BoardMessage*> _boardMessageQueue;
 
   uv_async_t _canBusMessageEmitAsync;
-  std::queue<CanBusMessage*> _canBusMessageQueue;
+  CanBusMessageQueue _canBusMessageQueue;
+
+  uv_async_t _pgnMessageEmitAsync;
+  std::queue<PgnMessage*> _pgnMessageQueue; // guarded by _reassemblyMutex
+
+  uv_mutex_t _reassemblyMutex;
+  bool _reassembly;
+  bool _reassemblyEmitFragments;
+  J1939Reassembler _reassembler;
+
+  uv_mutex_t _trafficStatsMutex;
+  bool _trafficStatsEnabled;
+  TrafficStats _trafficStats;
+
+  uv_mutex_t _autoResponseMutex;
+  std::vector<AutoResponse> _autoResponses;
+  std::vector<AutoResponse> _autoResponseMatches; // read thread only, reused for every frame
+  unsigned int _nextAutoResponseRule;
+
+  RealtimeConfig _realtimeConfig;
+  struct libusb_transfer* _busyPollTransfer; // read thread only
+  bool _priorityInheritance; // the mutexes shared with the read thread boost their owner
+  uv_mutex_t _readThreadStatsMutex;
+  ReadThreadStats _readThreadStats;
+
+  uv_async_t _busStateEmitAsync;
+  std::queue<BusStatus*> _busStateQueue;
+  uv_mutex_t _busMonitorMutex;
+  BusMonitor _busMonitor;
 
   uv_prepare_t _loopHolder;
 
@@ -87,11 +173,27 @@ protected:
   static void UsbCanErrorEmitter(uv_async_t *w);
   static void BoardMessageEmitter(uv_async_t *w);
   static void CanBusMessageEmitter(uv_async_t *w);
+  static void PgnMessageEmitter(uv_async_t *w);
+  static void BusStateEmitter(uv_async_t *w);
 
   int SendBoardMessage(unsigned int command);
   int SendCanBusMessage(bool rtr, unsigned int id, bool extendedId, unsigned char* data, int dataLength, unsigned int txFlags);
   int UsbWrite(unsigned char *txFrameData, int txFrameLength);
 
+  void RespondToCanBusMessage(CanBusMessage* message, uint64_t receivedAt);
+
+  void PollBusMonitor(uint64_t now);
+  bool ProcessBusMonitorReply(BoardMessage* message);
+
+#ifndef _WIN32
+  static void InitPriorityInheritanceMutex(uv_mutex_t* mutex);
+#endif
+  void ApplyRealtimeConfig();
+  int ReadUsbData(unsigned char* rxBuffer, int rxBufferLength);
+  int BusyPollUsbData(unsigned char* rxBuffer, int rxBufferLength);
+  void RecordUsbRead(int bytesRead, uint64_t interval);
+  void RecordUsbProcessing(uint64_t processing);
+
   static void UsbReadThread(void* arg);
 
 private:
@@ -0,0 +1,245 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "traffic_stats.h"
+#include <string.h>
+
+// CRC delimiter, ACK slot and delimiter, EOF and interframe space: never stuffed
+#define CAN_FRAME_TRAILER_BITS (1 + 2 + 7 + 3)
+
+#define CAN_CRC15_POLYNOMIAL 0x4599
+
+static int AppendBits(unsigned char* bits, int length, unsigned int value, int count)
+{
+  for (int i = count - 1; i >= 0; i--) {
+    bits[length++] = (value >> i) & 0x01;
+  }
+  return length;
+}
+
+unsigned int CanFrameBitLength(unsigned int id, bool extended, bool rtr, const unsigned char* data, int dataLength)
+{
+  // SOF, arbitration and control fields, data, CRC: 1 + 32 + 6 + 64 + 15 bits at most
+  unsigned char bits[128];
+  int length = 0;
+
+  if (dataLength > 8) {
+    dataLength = 8;
+  }
+
+  length = AppendBits(bits, length, 0, 1); // SOF
+  if (extended) {
+    length = AppendBits(bits, length, id >> 18, 11);
+    length = AppendBits(bits, length, 0x03, 2); // SRR, IDE
+    length = AppendBits(bits, length, id, 18);
+    length = AppendBits(bits, length, rtr ? 1 : 0, 1);
+    length = AppendBits(bits, length, 0, 2); // r1, r0
+  } else {
+    length = AppendBits(bits, length, id, 11);
+    length = AppendBits(bits, length, rtr ? 1 : 0, 1);
+    length = AppendBits(bits, length, 0, 2); // IDE, r0
+  }
+  length = AppendBits(bits, length, dataLength, 4);
+  if (!rtr) {
+    for (int i = 0; i < dataLength; i++) {
+      length = AppendBits(bits, length, data[i], 8);
+    }
+  }
+
+  unsigned int crc = 0;
+  for (int i = 0; i < length; i++) {
+    bool crcNext = bits[i] ^ ((crc >> 14) & 0x01);
+    crc = (crc << 1) & 0x7fff;
+    if (crcNext) {
+      crc ^= CAN_CRC15_POLYNOMIAL;
+    }
+  }
+  length = AppendBits(bits, length, crc, 15);
+
+  // A stuff bit follows every run of five identical bits, and starts a new run
+  unsigned int stuffBits = 0;
+  int run = 1;
+  unsigned char previous = bits[0];
+  for (int i = 1; i < length; i++) {
+    if (bits[i] == previous) {
+      run++;
+    } else {
+      previous = bits[i];
+      run = 1;
+    }
+
+    if (run == 5) {
+      stuffBits++;
+      previous = !previous;
+      run = 1;
+    }
+  }
+
+  return length + stuffBits + CAN_FRAME_TRAILER_BITS;
+}
+
+TrafficStats::TrafficStats()
+{
+  _baudRate = TRAFFIC_STATS_DEFAULT_BAUD_RATE;
+  Configure(0, TRAFFIC_STATS_DEFAULT_WINDOW, TRAFFIC_STATS_DEFAULT_TIMESTAMP_TICK);
+}
+
+void TrafficStats::Configure(unsigned int baudRate, unsigned int window, unsigned int timestampTick)
+{
+  if (baudRate > 0) {
+    _baudRate = baudRate;
+  }
+  _window = window > 0 ? window : TRAFFIC_STATS_DEFAULT_WINDOW;
+  _bucketLength = (uint64_t) _window * 1000000 / TRAFFIC_STATS_WINDOW_BUCKETS;
+  _timestampTick = (uint64_t) (timestampTick > 0 ? timestampTick : TRAFFIC_STATS_DEFAULT_TIMESTAMP_TICK) * 1000;
+  Reset();
+}
+
+void TrafficStats::SetBaudRate(unsigned int baudRate)
+{
+  _baudRate = baudRate;
+  _peakBusLoad = 0;
+}
+
+void TrafficStats::Reset()
+{
+  _frames = 0;
+  _bits = 0;
+  memset(_dlc, 0, sizeof _dlc);
+  memset(_windowBuckets, 0, sizeof _windowBuckets);
+  _windowBits = 0;
+  _currentBucket = 0;
+  _peakBusLoad = 0;
+  _ids.clear();
+}
+
+void TrafficStats::Record(unsigned int id, bool extended, bool rtr, const unsigned char* data, int dataLength,
+                          unsigned int timestamp, uint64_t now)
+{
+  unsigned int bits = CanFrameBitLength(id, extended, rtr, data, dataLength);
+
+  Advance(now);
+  _windowBuckets[_currentBucket % TRAFFIC_STATS_WINDOW_BUCKETS] += bits;
+  _windowBits += bits;
+
+  _frames++;
+  _bits += bits;
+  _dlc[dataLength < TRAFFIC_STATS_DLC_BUCKETS ? dataLength : TRAFFIC_STATS_DLC_BUCKETS - 1]++;
+
+  unsigned int key = (extended ? 0x80000000 : 0) | id;
+  std::unordered_map<unsigned int, IdTrafficStats>::iterator it = _ids.find(key);
+
+  if (it == _ids.end()) {
+    IdTrafficStats& stats = _ids[key];
+    memset(&stats, 0, sizeof stats);
+    stats.id = id;
+    stats.extended = extended;
+    stats.count = 1;
+    stats.lastTimestamp = timestamp;
+    return;
+  }
+
+  // The board timestamps the frames as they come off the bus, unlike the host which gets
+  // them in USB batches. Unsigned arithmetic handles the counter wrapping around.
+  IdTrafficStats& stats = it->second;
+  uint64_t interval = (uint64_t) (unsigned int) (timestamp - stats.lastTimestamp) * _timestampTick;
+
+  stats.count++;
+  stats.lastTimestamp = timestamp;
+
+  // Running mean and variance of the inter-arrival time, over count - 1 intervals
+  uint64_t n = stats.count - 1;
+  double delta = interval - stats.meanInterval;
+  stats.meanInterval += delta / n;
+  stats.m2Interval += delta * (interval - stats.meanInterval);
+
+  if (n == 1 || interval < stats.minInterval) {
+    stats.minInterval = interval;
+  }
+  if (interval > stats.maxInterval) {
+    stats.maxInterval = interval;
+  }
+
+  int bucket = 0;
+  for (uint64_t us = interval / 1000; us > 1 && bucket < TRAFFIC_STATS_INTERVAL_BUCKETS - 1; us >>= 1) {
+    bucket++;
+  }
+  stats.intervals[bucket]++;
+}
+
+void TrafficStats::Snapshot(uint64_t now, TrafficStatsSnapshot* snapshot)
+{
+  Advance(now);
+
+  snapshot->baudRate = _baudRate;
+  snapshot->window = _window;
+  snapshot->frames = _frames;
+  snapshot->bits = _bits;
+  snapshot->busLoad = WindowLoad();
+  snapshot->peakBusLoad = _peakBusLoad;
+  memcpy(snapshot->dlc, _dlc, sizeof _dlc);
+
+  snapshot->ids.clear();
+  snapshot->ids.reserve(_ids.size());
+  for (std::unordered_map<unsigned int, IdTrafficStats>::iterator it = _ids.begin(); it != _ids.end(); ++it) {
+    snapshot->ids.push_back(it->second);
+  }
+}
+
+void TrafficStats::Advance(uint64_t now)
+{
+  uint64_t bucket = now / _bucketLength;
+
+  if (bucket <= _currentBucket) {
+    return;
+  }
+
+  // The window just completed is a candidate for the peak
+  if (_currentBucket > 0) {
+    double load = WindowLoad();
+    if (load > _peakBusLoad) {
+      _peakBusLoad = load;
+    }
+  }
+
+  uint64_t elapsed = bucket - _currentBucket;
+  if (elapsed > TRAFFIC_STATS_WINDOW_BUCKETS || _currentBucket == 0) {
+    elapsed = TRAFFIC_STATS_WINDOW_BUCKETS;
+  }
+
+  for (uint64_t i = 1; i <= elapsed; i++) {
+    uint64_t& bits = _windowBuckets[(_currentBucket + i) % TRAFFIC_STATS_WINDOW_BUCKETS];
+    _windowBits -= bits;
+    bits = 0;
+  }
+
+  _currentBucket = bucket;
+}
+
+double TrafficStats::WindowLoad() const
+{
+  if (_baudRate == 0) {
+    return 0;
+  }
+
+  return 100.0 * _windowBits / ((double) _baudRate * _window / 1000);
+}
@@ -0,0 +1,103 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#ifndef TRAFFIC_STATS_H
+#define TRAFFIC_STATS_H
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#define TRAFFIC_STATS_DEFAULT_BAUD_RATE 250000
+#define TRAFFIC_STATS_DEFAULT_WINDOW 1000 // milliseconds
+#define TRAFFIC_STATS_DEFAULT_TIMESTAMP_TICK 1000 // microseconds per board timestamp tick
+
+#define TRAFFIC_STATS_WINDOW_BUCKETS 50
+#define TRAFFIC_STATS_INTERVAL_BUCKETS 24 // log2 of the inter-arrival time in microseconds, up to ~16 s
+#define TRAFFIC_STATS_DLC_BUCKETS 9
+
+typedef struct {
+  unsigned int id;
+  bool extended;
+  uint64_t count;
+  unsigned int lastTimestamp; // board timestamp ticks
+  double meanInterval;  // nanoseconds, running mean and variance (Welford)
+  double m2Interval;
+  uint64_t minInterval;
+  uint64_t maxInterval;
+  unsigned int intervals[TRAFFIC_STATS_INTERVAL_BUCKETS];
+} IdTrafficStats;
+
+typedef struct {
+  unsigned int baudRate;
+  unsigned int window;
+  uint64_t frames;
+  uint64_t bits;
+  double busLoad; // percent, over the last window
+  double peakBusLoad;
+  uint64_t dlc[TRAFFIC_STATS_DLC_BUCKETS];
+  std::vector<IdTrafficStats> ids;
+} TrafficStatsSnapshot;
+
+// Number of bits a frame occupies on the bus, stuff bits and interframe space included
+unsigned int CanFrameBitLength(unsigned int id, bool extended, bool rtr, const unsigned char* data, int dataLength);
+
+// Aggregates of the CAN bus traffic, updated by the read thread for every frame.
+// Not thread-safe: callers serialize the access.
+class TrafficStats
+{
+public:
+  TrafficStats();
+
+  // A baudRate of 0 keeps the current one
+  void Configure(unsigned int baudRate, unsigned int window, unsigned int timestampTick);
+  void SetBaudRate(unsigned int baudRate);
+  void Reset();
+
+  // Intervals come from the board timestamp of the frame, the bus load window from the host clock (now)
+  void Record(unsigned int id, bool extended, bool rtr, const unsigned char* data, int dataLength,
+              unsigned int timestamp, uint64_t now);
+  void Snapshot(uint64_t now, TrafficStatsSnapshot* snapshot);
+
+private:
+  void Advance(uint64_t now);
+  double WindowLoad() const;
+
+  unsigned int _baudRate;
+  unsigned int _window;
+  uint64_t _bucketLength; // nanoseconds
+  uint64_t _timestampTick; // nanoseconds
+
+  uint64_t _frames;
+  uint64_t _bits;
+  uint64_t _dlc[TRAFFIC_STATS_DLC_BUCKETS];
+
+  // Sliding window of bits seen on the bus
+  uint64_t _windowBuckets[TRAFFIC_STATS_WINDOW_BUCKETS];
+  uint64_t _windowBits;
+  uint64_t _currentBucket;
+  double _peakBusLoad;
+
+  std::unordered_map<unsigned int, IdTrafficStats> _ids; // keyed by extended << 31 | id
+};
+
+#endif
@@ -0,0 +1,209 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "usbcan_frame.h"
+
+void InitUsbFrameDecoder(UsbFrameDecoder* decoder)
+{
+  decoder->state = RX_FRAME_IDLE;
+  decoder->length = 0;
+  decoder->checksum = 0;
+}
+
+ReadFrameState DecodeUsbByte(UsbFrameDecoder* decoder, unsigned char inByte)
+{
+  // IMPORTANT: We assume we're in RUN mode. DOWNLOAD mode is unsupported.
+
+  // Process the byte and try to append to frame data.
+  // This section could have implemented with the state pattern, but
+  // it's a bit too much for this situation.
+
+  switch (decoder->state) {
+    case RX_FRAME_IDLE:
+    case RX_FRAME_COMPLETE:
+    case RX_FRAME_ERROR_EXPECTING_DLE:
+    case RX_FRAME_ERROR_EXPECTING_STX:
+    case RX_FRAME_ERROR_EXPECTING_ETX:
+    case RX_FRAME_ERROR_BAD_CHECKSUM:
+    case RX_FRAME_ERROR_BUFFER_OVERFLOW:
+      if (inByte == USB_DLE) {
+        decoder->state = RX_FRAME_START;
+        decoder->checksum = 0;
+        decoder->length = 0;
+      } else {
+        decoder->state = RX_FRAME_ERROR_EXPECTING_DLE;
+      }
+      break;
+    case RX_FRAME_START:
+      if (inByte == USB_STX) {
+        decoder->state = RX_FRAME_CONTENT;
+      } else {
+        decoder->state = RX_FRAME_ERROR_EXPECTING_STX;
+      }
+      break;
+    case RX_FRAME_CONTENT:
+      if (inByte == USB_DLE) {
+        decoder->state = RX_FRAME_CONTENT_NLE;
+      } else {
+        // We append content in frame buffer and computer checksum
+        if (decoder->length < RX_FRAME_DATA_MAX_LENGTH) {
+          decoder->data[decoder->length] = inByte;
+          decoder->checksum ^= inByte;
+          decoder->length++;
+        } else {
+          decoder->state = RX_FRAME_ERROR_BUFFER_OVERFLOW;
+        }
+      }
+      break;
+    case RX_FRAME_CONTENT_NLE:
+      if (inByte == USB_ETX) {
+        if (decoder->checksum == 0) { // checksum should be zero if message was good
+          decoder->state = RX_FRAME_COMPLETE;
+          decoder->length--; // we are always 1 ahead
+        } else {
+          decoder->state = RX_FRAME_ERROR_BAD_CHECKSUM;
+        }
+      } else if (inByte == USB_STX) {
+        decoder->state = RX_FRAME_ERROR_EXPECTING_ETX;
+      } else {
+        // We append content in frame buffer and computer checksum
+        if (decoder->length < RX_FRAME_DATA_MAX_LENGTH) {
+          decoder->data[decoder->length] = inByte;
+          decoder->checksum ^= inByte;
+          decoder->length++;
+          decoder->state = RX_FRAME_CONTENT;
+        } else {
+          decoder->state = RX_FRAME_ERROR_BUFFER_OVERFLOW;
+        }
+      }
+      break;
+  }
+
+  return decoder->state;
+}
+
+int EncodeUsbFrame(const unsigned char* txFrameData, int txFrameLength, unsigned char* txBuffer)
+{
+  // USB message format
+  // ------------------
+  // [0] DLE
+  // [1] STX
+  // [2..n-3] data, but if data contains a DLE, then insert another DLE before it (BYTE Stuffing)
+  // [n-2] CSUM
+  // [n-1] DLE
+  // [n] ETX
+  int txLength = 0;
+  unsigned char txFrameChecksum = 0;
+
+  // Start the transmission
+  txBuffer[txLength++] = USB_DLE;
+  txBuffer[txLength++] = USB_STX;  // start transmission
+
+  // BYTE Stuff the data and calculate checksum
+  for (int i = 0; i < txFrameLength; i++) {
+    txFrameChecksum ^= txFrameData[i];
+
+    if (txFrameData[i] == USB_DLE) {
+      txBuffer[txLength++] = USB_DLE;
+    }
+    txBuffer[txLength++] = txFrameData[i];
+  }
+
+  // BYTE STUFF checksum if necessary
+  if (txFrameChecksum == USB_DLE) {
+    txBuffer[txLength++] = USB_DLE;
+  }
+
+  // Send the checksum
+  txBuffer[txLength++] = txFrameChecksum;
+
+  // Terminate the transmission
+  txBuffer[txLength++] = USB_DLE;
+  txBuffer[txLength++] = USB_ETX;  // end transmission
+
+  return txLength;
+}
+
+// ------ Message Factory Methods ------
+
+BoardMessage* CreateBoardMessage(unsigned char* rxFrameData, int rxFrameLength)
+{
+  // Unsolicited Emergency Message from the board
+  // --------------------------------------------
+  // [0] 0xFF
+  // [1] 0x80
+  // [2] ERRORCODE (0-255)
+  //
+  // Response to config message from board
+  // -------------------------------------
+  // [0] 0x00
+  // [1] command | 0x80
+  // [2..n] response data               
+
+  BoardMessage* message = new BoardMessage;
+  message->id = rxFrameData[0];
+  message->command = rxFrameData[1] & 0x7f;
+  message->dataLength = rxFrameLength - 2; // minus two for the first two bytes
+  for (int i = 0; i < message->dataLength && i < (int) sizeof(message->data); i++) { 
+    message->data[i] = rxFrameData[i + 2];
+  }
+
+  return message;
+}
+
+CanBusMessage* CreateCanBusMessage(unsigned char* rxFrameData, int rxFrameLength)
+{
+  // Incoming CAN Message
+  // --------------------
+  // [0] ([1][RTR][EXT][unused 0..4]) (WARNING: never send back 0xFF, its reserved for emergency)
+  // [1] ID MSB
+  // [2] ID
+  // [3] ID
+  // [4] ID LSB
+  // [5] TIMESTAMP MSB
+  // [6] TIMESTAMP 
+  // [7] TIMESTAMP 
+  // [8] TIMESTAMP LSB
+  // [9] RESERVED FOR RX FLAGS
+  // [10] DATA LEN (0-8)
+  // [11-18] DATA BYTES 0 to 8 (if needed)
+
+  CanBusMessage *message = new CanBusMessage;
+  message->rtr = (rxFrameData[0] & 0x40) ? true : false;
+  message->extended = (rxFrameData[0] & 0x20) ? true : false;
+  message->id = (((unsigned int) rxFrameData[4] << 24) & 0x1f000000) |
+                (((unsigned int) rxFrameData[3] << 16) & 0x00ff0000) |
+                (((unsigned int) rxFrameData[2] << 8) & 0x0000ff00) |
+                (((unsigned int) rxFrameData[1]) & 0x000000ff);
+  message->timestamp = (((unsigned int) rxFrameData[8] << 24) & 0xff000000) |
+                       (((unsigned int) rxFrameData[7] << 16) & 0x00ff0000) |
+                       (((unsigned int) rxFrameData[6] << 8) & 0x0000ff00) |
+                       (((unsigned int) rxFrameData[5]) & 0x000000ff);
+  message->flags = rxFrameData[9];
+
+  message->dataLength = rxFrameData[10]; // minus two for the first two bytes
+  for (int i = 0; i < message->dataLength && i < (int) sizeof(message->data); i++) { 
+    message->data[i] = rxFrameData[i + 11];
+  }
+
+  return message;
+}
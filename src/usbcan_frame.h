@@ -0,0 +1,90 @@
+// Copyright (C) 2012, Georges-Etienne Legendre <legege@legege.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the
+// "Software"), to deal in the Software without restriction, including
+// without limitation the rights to use, copy, modify, merge, publish,
+// distribute, sublicense, and/or sell copies of the Software, and to permit
+// persons to whom the Software is furnished to do so, subject to the
+// following conditions:
+//
+// The above copyright notice and this permission notice shall be included
+// in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+// OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+// USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#ifndef USBCAN_FRAME_H
+#define USBCAN_FRAME_H
+
+// Framing of the messages exchanged with the USB-CAN board. Nothing in here
+// depends on node or libftdi, so it can be used outside of the addon.
+
+// Definitions for USB message start and end char
+#define USB_DLE 0x10
+#define USB_STX 0x02
+#define USB_ETX 0x03
+
+#define RX_FRAME_DATA_MAX_LENGTH 32768 // XXX Isn't it a bit too big? There is only one Board or CAN Bus message that's going to fit in here.
+
+// Worst case of a stuffed frame: every byte escaped, plus DLE STX, checksum and DLE ETX
+#define TX_BUFFER_LENGTH(txFrameLength) (2 * (txFrameLength) + 6)
+
+typedef struct {  
+  unsigned int id;
+  unsigned int command;
+  unsigned char data[255];
+  int dataLength;
+} BoardMessage;
+
+typedef struct {
+  unsigned int id;
+  bool rtr; // remote transmission request (RTR)
+  bool extended; // false = 11 bit identifier, true = 29 bit identifier
+  unsigned int timestamp;
+  unsigned char data[255]; // XXX 8 bytes only?
+  int dataLength;
+  unsigned int flags;
+} CanBusMessage;
+
+enum ReadFrameState {
+  RX_FRAME_IDLE,
+  RX_FRAME_START,
+  RX_FRAME_CONTENT,
+  RX_FRAME_CONTENT_NLE,
+  RX_FRAME_COMPLETE,
+  RX_FRAME_ERROR_EXPECTING_DLE,
+  RX_FRAME_ERROR_EXPECTING_STX,
+  RX_FRAME_ERROR_EXPECTING_ETX,
+  RX_FRAME_ERROR_BAD_CHECKSUM,
+  RX_FRAME_ERROR_BUFFER_OVERFLOW
+};
+
+typedef struct {
+  ReadFrameState state;
+  unsigned char data[RX_FRAME_DATA_MAX_LENGTH];
+  int length;
+  unsigned char checksum;
+} UsbFrameDecoder;
+
+void InitUsbFrameDecoder(UsbFrameDecoder* decoder);
+
+// Feeds one byte received from the board and returns the new decoder state.
+// Every byte leading to an RX_FRAME_ERROR_* state is dropped. Once
+// RX_FRAME_COMPLETE is returned, the frame is in decoder->data.
+ReadFrameState DecodeUsbByte(UsbFrameDecoder* decoder, unsigned char inByte);
+
+// Stuffs and checksums a frame into txBuffer, which must hold at least
+// TX_BUFFER_LENGTH(txFrameLength) bytes. Returns the number of bytes to send.
+int EncodeUsbFrame(const unsigned char* txFrameData, int txFrameLength, unsigned char* txBuffer);
+
+BoardMessage* CreateBoardMessage(unsigned char* rxFrameData, int rxFrameLength);
+CanBusMessage* CreateCanBusMessage(unsigned char* rxFrameData, int rxFrameLength);
+
+#endif